@@ -5,6 +5,19 @@
 #include "Awaitable.h"
 
 #include <iostream>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <deque>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
 
 using namespace pi;
 
@@ -24,13 +37,15 @@ nawaitable set_exception_after_timeout(awaitable<int> a, std::chrono::high_resol
 
 awaitable<int> named_counter(std::string name)
 {
+    co_await trace_label("named_counter");
+
     std::cout << "counter(" << name << ") resumed #" << 0 << std::endl;
 
     co_await 5s; // timed wait
     std::cout << "counter(" << name << ") resumed #" << 1 << std::endl;
 
-    int i = co_await awaitable<int>{}; // yield, returns the default value
-    std::cout << "counter(" << name << ") resumed #" << 2 << " ### " << i << std::endl;
+    co_await yield();
+    std::cout << "counter(" << name << ") resumed #" << 2 << std::endl;
 
     {
         auto a = awaitable<int>{ true }; // suspend, and returns the value from somewhere else
@@ -54,6 +69,35 @@ awaitable<int> named_counter(std::string name)
     co_return 42;
 }
 
+// NB: move-only, and not default constructible
+struct buffer
+{
+    explicit buffer(size_t size)
+        : _data(new char[size])
+        , _size(size)
+    {
+    }
+
+    buffer(buffer&&) = default;
+
+    std::unique_ptr<char[]> _data;
+    size_t _size;
+};
+
+awaitable<buffer> make_buffer(size_t size)
+{
+    co_await 1s;
+
+    co_return buffer{ size };
+}
+
+nawaitable test_shared_buffer(awaitable<buffer> a, std::string name)
+{
+    const buffer& b = co_await a; // NB: all the awaiters share the same result, no copy
+
+    std::cout << "### test_shared_buffer: " << name << " ### " << b._size << std::endl;
+}
+
 awaitable<void> test_exception()
 {
     co_await 0s;
@@ -72,6 +116,8 @@ nawaitable test_multi_await(awaitable<int> a, const std::string& name)
 
 nawaitable test()
 {
+    co_await trace_label("test");
+
     try
     {
         co_await test_exception();
@@ -131,6 +177,29 @@ nawaitable test()
         std::cout << "co_await awaitable<void>::when_all(as)" << std::endl;
     }
 
+    {
+        // NB: the stateless kinds are lifted by as_awaitable, so that they can be mixed with timers, events and coroutines
+        auto a1 = as_awaitable(sleep_for(2s));
+        auto a2 = awaitable<void>{ 3s };
+        auto a3 = as_awaitable(yield());
+        std::deque<awaitable<void>> as{ a1, a2, a3 };
+        auto ar = co_await awaitable<void>::when_any(as);
+        assert(ar == a3);
+        co_await awaitable<void>::when_all(as);
+        std::cout << "co_await awaitable<void>::when_all(sleep_for, timer, yield)" << std::endl;
+    }
+
+    {
+        auto b = co_await make_buffer(1024); // NB: the sole awaiter of a temporary, the result is moved out
+        std::cout << "co_await make_buffer(1024) ### " << b._size << std::endl;
+
+        auto a = make_buffer(2048);
+        test_shared_buffer(a, "A");
+        test_shared_buffer(a, "B");
+        co_await a;
+        std::cout << "### after 'co_await make_buffer(2048)' ### " << std::endl;
+    }
+
     auto x = co_await named_counter("x");
     std::cout << "### after co_await named_counter(x): " << x << std::endl;
 
@@ -150,13 +219,10 @@ nawaitable test_cancellation_1(cancellation::token token)
     auto a = awaitable<int>{ true }; // suspend, and returns the value from somewhere else
 
     // NB: I rely on the fact that a stays on the stack, so I can capture it by reference
-    token.register_action([&a] { a.set_exception(std::make_exception_ptr(std::exception("test_cancellation_1"))); });
+    token.register_action([&a] { a.cancel(); });
 
-    try
-    {
-        auto x = co_await a;
-    }
-    catch (std::exception e)
+    auto x = co_await a.result(); // NB: no exception is thrown on cancellation
+    if (x.cancelled())
     {
         std::cout << "test_cancellation_1: canceled!" << std::endl;
     }
@@ -166,30 +232,519 @@ nawaitable test_cancellation_2(cancellation::token token)
 {
     auto a = awaitable<void>{ 4s };
 
-    token.register_action([&a] { a.set_exception(std::make_exception_ptr(std::exception("test_cancellation_2"))); });
+    token.register_action([&a] { a.cancel(); });
 
     try
     {
         co_await a;
     }
-    catch (std::exception e)
+    catch (const std::system_error& e)
+    {
+        std::cout << "test_cancellation_2: canceled! " << e.code().message() << std::endl;
+    }
+}
+
+nawaitable test_cancellation_3(cancellation::token token)
+{
+    // NB: the timer lives in this coroutine's frame, and is unlinked from the executor on cancellation
+    auto r = co_await sleep_for(10s, token);
+    if (r.cancelled())
+    {
+        std::cout << "test_cancellation_3: canceled!" << std::endl;
+    }
+}
+
+nawaitable test_linked_cancellation(cancellation::token token, std::string name)
+{
+    auto r = co_await sleep_for(10s, token);
+    std::cout << "test_linked_cancellation: " << name << (r.cancelled() ? " canceled!" : " done") << std::endl;
+}
+
+nawaitable test_executor_affinity(executor& shard)
+{
+    auto a = awaitable<int>{ true };
+    set_ready_after_timeout(a, 2s); // NB: set_ready is called from the default executor
+
+    co_await schedule_on(shard);
+    assert(&executor::current() == &shard);
+
+    auto x = co_await a; // NB: the awaiter is resumed on the executor it was suspended on
+    assert(&executor::current() == &shard);
+    std::cout << "test_executor_affinity: resumed on shard ### " << x << std::endl;
+
+    co_await schedule_on(executor::singleton());
+    assert(&executor::current() == &executor::singleton());
+    std::cout << "test_executor_affinity: back on the default executor" << std::endl;
+}
+
+awaitable<std::string> load_profile(int id, int& num_loads)
+{
+    ++num_loads;
+    co_await 1s;
+
+    co_return "profile#" + std::to_string(id);
+}
+
+nawaitable test_single_flight_get(single_flight<int, std::string>& cache, int id, int& num_loads)
+{
+    auto a = cache.get(id, [id, &num_loads] { return load_profile(id, num_loads); });
+    const std::string& profile = co_await a; // NB: shared with the cache, no copy
+
+    std::cout << "test_single_flight: " << profile << " loaded " << num_loads << " time(s)" << std::endl;
+}
+
+nawaitable test_single_flight()
+{
+    single_flight<int, std::string> cache{ 16, 2s };
+    int num_loads = 0;
+
+    // NB: concurrent requests of a cold key are collapsed into a single load
+    test_single_flight_get(cache, 1, num_loads);
+    test_single_flight_get(cache, 1, num_loads);
+    test_single_flight_get(cache, 1, num_loads);
+
+    co_await 1500ms;
+    test_single_flight_get(cache, 1, num_loads); // cached
+
+    co_await 2s;
+    test_single_flight_get(cache, 1, num_loads); // expired, loaded again
+
+    co_await 1500ms;
+}
+
+nawaitable test_select_set()
+{
+    // NB: the awaitables are registered once, rather than once per wait
+    select_set<int> set;
+    std::deque<awaitable<int>> as{ awaitable<int>{ true }, awaitable<int>{ true }, awaitable<int>{ true } };
+    for (auto& a : as)
     {
-        std::cout << "test_cancellation_2: canceled!" << std::endl;
+        set.add(a);
+        set_ready_after_timeout(a, 1s);
+    }
+    as[2].cancel();
+
+    while (set.size() > 0)
+    {
+        auto& batch = co_await set.next();
+        for (auto& a : batch)
+        {
+            auto r = co_await a.result();
+            std::cout << "test_select_set: " << (r ? std::to_string(r.value()) : r.error().message()) << std::endl;
+        }
     }
 }
 
-int main()
+nawaitable test_periodic_timer(cancellation::token token)
 {
+    // NB: unlike while (true) { work(); co_await 1s; }, the cadence doesn't drift by the time spent on the work
+    periodic_timer timer{ 1s, token };
+    while (true)
+    {
+        auto ticks = co_await timer.tick();
+        if (!ticks)
+        {
+            break;
+        }
+        std::cout << "test_periodic_timer: tick x" << ticks.value() << std::endl;
+    }
+    std::cout << "test_periodic_timer: canceled!" << std::endl;
+}
+
+nawaitable test_rate_limited_call(async_rate_limiter& limiter, int id)
+{
+    co_await limiter.acquire();
+    std::cout << "test_rate_limited_call: #" << id << std::endl;
+}
+
+nawaitable test_rate_limiter()
+{
+    async_rate_limiter limiter{ 2, 2 }; // NB: 2 calls per second, with a burst of 2
+    for (int i = 0; i < 6; ++i)
+    {
+        test_rate_limited_call(limiter, i);
+    }
+    co_await 3s;
+}
+
+awaitable<int> fetch_part(int id, cancellation::token token)
+{
+    co_await sleep_for(100ms * id, token);
+    co_return id;
+}
+
+awaitable<int> serve_request(int id, cancellation::token token)
+{
+    std::deque<awaitable<int>> parts{ fetch_part(1, token), fetch_part(2, token), fetch_part(3, token) };
+    co_await awaitable<int>::when_all(parts, token);
+    co_return id * 100 + parts[0].get_value() + parts[1].get_value() + parts[2].get_value();
+}
+
+nawaitable test_request_arena()
+{
+    // NB: the coroutines taking the request's token, the when_all helpers and the shared states are all allocated from the request's arena
+    auto a = std::make_shared<arena>(4 * 1024);
+    for (int id = 1; id <= 2; ++id)
+    {
+        cancellation request{ a };
+        auto r = co_await serve_request(id, request.get_token());
+        std::cout << "### request " << r << " served from the arena: " << a->reserved() << " bytes reserved, " << a->num_fallbacks() << " fallbacks" << std::endl;
+    }
+    assert(a->num_live() == 0); // NB: rewound after each request, the blocks are reused by the next one
+}
+
+nawaitable dump_async_stacks_after_timeout(std::chrono::high_resolution_clock::duration timeout)
+{
+    co_await timeout;
+
+    tracer::instance().dump_async_stacks(std::cout);
+}
+
+// NB: the stress/soak harness, run by: Awaitable --soak [requests] [seed] [seconds] [concurrency] [arena block size, 0 for the heap]
+// every request is a randomized tree of coroutines - yields, timers, set_ready, exceptions, when_any/when_all races and cancellations;
+// the shape of each tree is a pure function of the seed and the request id, so that a failing run can be replayed with the same seed,
+// only the outcome of the timer races (e.g. what gets cancelled) depends on the wall clock
+struct soak_context
+{
+    soak_context(unsigned seed, size_t num_requests, size_t arena_block_size)
+        : _seed(seed)
+        , _num_requests(num_requests)
+        , _arena_block_size(arena_block_size)
+    {
+    }
+
+    // NB: counts the live soak coroutines, embedded in their frames
+    struct frame_guard
+    {
+        explicit frame_guard(soak_context& s)
+            : _s(s)
+        {
+            ++_s._spawned;
+            _s._peak_live = std::max(_s._peak_live, ++_s._live);
+        }
+
+        ~frame_guard()
+        {
+            --_s._live;
+        }
+
+        soak_context& _s;
+    };
+
+    template <typename R>
+    bool settle(const R& r)
+    {
+        if (r)
+        {
+            ++_completed;
+        }
+        else if (r.cancelled())
+        {
+            ++_cancelled;
+        }
+        else
+        {
+            ++_failed;
+        }
+        return static_cast<bool>(r);
+    }
+
+    unsigned request_seed(size_t id) const
+    {
+        return static_cast<unsigned>(_seed * 2654435761u + id);
+    }
+
+    unsigned _seed;
+    size_t _num_requests;
+    size_t _next_request = 0;
+    size_t _arena_block_size;
+    size_t _workers = 0;
+
+    // NB: one arena per request, which must be gone once everything beneath the request is
+    std::vector<std::weak_ptr<arena>> _arenas;
+    size_t _fallbacks = 0;
+
+    size_t _spawned = 0;
+    size_t _live = 0;
+    size_t _peak_live = 0;
+    size_t _completed = 0;
+    size_t _failed = 0;
+    size_t _cancelled = 0;
+};
+
+nawaitable soak_set_ready_later(awaitable<int> a, int value)
+{
+    co_await yield();
+    a.set_ready(value);
+}
+
+awaitable<int> soak_task(soak_context& s, unsigned seed, int depth, cancellation::token token)
+{
+    soak_context::frame_guard guard(s);
+    std::minstd_rand rng(seed);
+
+    int sum = 0;
+    for (int ops = rng() % 4 + 1; ops > 0; --ops)
+    {
+        // NB: the leaves don't spawn any children
+        switch (rng() % (depth < 3 ? 9 : 5))
+        {
+        case 0:
+            co_await yield();
+            break;
+
+        case 1:
+            // NB: a cancelled sleep doesn't end the task, so that the shape of the tree doesn't depend on the timing
+            co_await sleep_for(milliseconds(rng() % 4), token);
+            break;
+
+        case 2:
+            co_await awaitable<void>{ milliseconds(rng() % 4) };
+            break;
+
+        case 3:
+        {
+            awaitable<int> a{ token.get_arena() };
+            soak_set_ready_later(a, 1);
+            sum += co_await a;
+            break;
+        }
+
+        case 4:
+            if (rng() % 8 == 0)
+            {
+                throw std::exception("soak_task");
+            }
+            break;
+
+        case 5:
+        {
+            auto r = co_await soak_task(s, rng(), depth + 1, token).result();
+            if (s.settle(r))
+            {
+                sum += r.value();
+            }
+            break;
+        }
+
+        case 6:
+        case 7:
+        {
+            bool all = rng() % 2 == 0;
+            std::deque<awaitable<int>> children;
+            for (int n = rng() % 3 + 2; n > 0; --n)
+            {
+                children.push_back(soak_task(s, rng(), depth + 1, token));
+            }
+
+            if (all)
+            {
+                auto r = co_await awaitable<int>::when_all(children, token).result();
+                if (s.settle(r))
+                {
+                    for (auto& child : children)
+                    {
+                        sum += child.get_value();
+                    }
+                }
+            }
+            else
+            {
+                // NB: the losers carry on by themselves
+                auto r = co_await awaitable<int>::when_any(children, token).result();
+                if (s.settle(r))
+                {
+                    auto winner = co_await r.value().result();
+                    if (s.settle(winner))
+                    {
+                        sum += winner.value();
+                    }
+                }
+            }
+            break;
+        }
+
+        case 8:
+        {
+            cancellation sub{ token };
+            if (rng() % 2 == 0)
+            {
+                cancel_after_timeout(sub, milliseconds(rng() % 4));
+            }
+            auto r = co_await soak_task(s, rng(), depth + 1, sub.get_token()).result();
+            if (s.settle(r))
+            {
+                sum += r.value();
+            }
+            break;
+        }
+        }
+    }
+
+    co_return sum;
+}
+
+nawaitable soak_worker(soak_context& s)
+{
+    ++s._workers;
+    while (s._next_request < s._num_requests)
+    {
+        auto id = s._next_request++;
+        std::minstd_rand rng(s.request_seed(id));
+
+        auto a = s._arena_block_size > 0 ? std::make_shared<arena>(s._arena_block_size) : nullptr;
+        s._arenas.push_back(a);
+
+        cancellation request{ a };
+        if (rng() % 4 == 0)
+        {
+            cancel_after_timeout(request, milliseconds(rng() % 8));
+        }
+
+        auto r = co_await soak_task(s, rng(), 0, request.get_token()).result();
+        s.settle(r);
+        s._fallbacks += a ? a->num_fallbacks() : 0;
+    }
+    --s._workers;
+}
+
+size_t peak_rss()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+bool soak_check(bool invariant, const char* what)
+{
+    if (!invariant)
+    {
+        std::cout << "### soak: invariant violated: " << what << std::endl;
+    }
+    return invariant;
+}
+
+int soak(size_t num_requests, unsigned seed, size_t seconds, size_t concurrency, size_t arena_block_size)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    auto rss = peak_rss();
+
+    // NB: a round that is still busy by then is stuck, e.g. on a lost wakeup or a timer that is never removed
+    const auto watchdog = 5min;
+
+    for (unsigned round = 0; ; ++round)
+    {
+        auto round_start = std::chrono::high_resolution_clock::now();
+
+        soak_context s{ seed + round, num_requests, arena_block_size };
+        for (size_t i = 0; i < concurrency; ++i)
+        {
+            soak_worker(s);
+        }
+
+        // NB: not loop(), which only returns once everything is drained, hanging on a leak instead of reporting it
+        auto& ex = executor::singleton();
+        auto deadline = round_start + watchdog;
+        bool busy = true;
+        while (busy && std::chrono::high_resolution_clock::now() < deadline)
+        {
+            busy = ex.tick();
+        }
+
+        bool ok = soak_check(!busy, "the executor drains before the watchdog");
+        ok &= soak_check(s._workers == 0, "all the workers are done");
+        ok &= soak_check(s._live == 0, "all the coroutine frames are gone");
+        ok &= soak_check(ex.num_ready_coros() == 0, "no ready coroutines are left behind");
+        ok &= soak_check(ex.num_timers() == 0, "no timers are left behind");
+        ok &= soak_check(ex.num_outstanding_coros() == 0, "the outstanding coroutines counter is back to zero");
+        for (auto& a : s._arenas)
+        {
+            ok &= soak_check(a.expired(), "the request arenas are released");
+        }
+
+        auto now = std::chrono::high_resolution_clock::now();
+        std::cout << "### soak round " << round << ": seed " << s._seed << ", " << num_requests << " requests, " << s._spawned << " coroutines (peak " << s._peak_live << " live), "
+            << s._completed << " completed, " << s._failed << " failed, " << s._cancelled << " cancelled, " << s._fallbacks << " arena fallbacks, "
+            << duration_cast<milliseconds>(now - round_start).count() << "ms" << std::endl;
+
+        if (round == 0)
+        {
+            auto peak = peak_rss();
+            std::cout << "### soak: peak RSS " << peak / (1024 * 1024) << "MB, ~" << (peak - rss) / std::max<size_t>(s._peak_live, 1) << " bytes per live coroutine" << std::endl;
+        }
+
+        if (!ok)
+        {
+            return 1;
+        }
+        if (now - start >= std::chrono::seconds(seconds))
+        {
+            break;
+        }
+    }
+
+    std::cout << "### soak: peak RSS " << peak_rss() / (1024 * 1024) << "MB" << std::endl;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "--soak")
+    {
+        return soak(argc > 2 ? std::stoul(argv[2]) : 60000, argc > 3 ? std::stoul(argv[3]) : 1, argc > 4 ? std::stoul(argv[4]) : 0, argc > 5 ? std::stoul(argv[5]) : 1000, argc > 6 ? std::stoul(argv[6]) : 8 * 1024);
+    }
+
+    tracer::instance().start_capture();
+    dump_async_stacks_after_timeout(20s);
+
     {
         cancellation source;
         cancel_after_timeout(source, 3s);
         test_cancellation_1(source.get_token());
         test_cancellation_2(source.get_token());
+        test_cancellation_3(source.get_token());
+        test_periodic_timer(source.get_token());
+    }
+
+    {
+        // NB: a request tree - cancelling the request cancels all the sub-requests, while each sub-request can also be cancelled on its own
+        cancellation request;
+        cancellation sub_request_1{ request.get_token() };
+        cancellation sub_request_2{ request.get_token() };
+        cancellation sub_sub_request{ sub_request_2.get_token() };
+        test_linked_cancellation(sub_request_1.get_token(), "sub_request_1");
+        test_linked_cancellation(sub_request_2.get_token(), "sub_request_2");
+        test_linked_cancellation(sub_sub_request.get_token(), "sub_sub_request");
+        sub_request_1.fire();
+        cancel_after_timeout(request, 1s);
     }
 
     test();
 
-    executor::singleton().loop();
+    test_single_flight();
+    test_select_set();
+    test_rate_limiter();
+    test_request_arena();
+
+    executor shard;
+    test_executor_affinity(shard);
+
+    while (executor::singleton().tick() | shard.tick())
+        ;
+
+    tracer::instance().stop_capture();
+    if (tracer::enabled)
+    {
+        std::ofstream os("awaitable_trace.json");
+        tracer::instance().write_chrome_trace(os);
+    }
+
     return 0;
 }
 
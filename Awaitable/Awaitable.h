@@ -2,16 +2,34 @@
 
 #include <map>
 #include <list>
-#include <queue>
 #include <chrono>
 #include <string>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <type_traits>
 #include <functional>
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <system_error>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <deque>
 #include <unordered_set>
 #include <unordered_map>
 #include <experimental/coroutine>
 
 #include <cassert>
 
+#if defined(PI_AWAITABLE_TRACE)
+#include <ostream>
+#include <thread>
+#else
+#include <iosfwd>
+#endif
+
 using namespace std::chrono;
 using namespace std::experimental;
 
@@ -51,718 +69,2948 @@ namespace pi
         T* _ptr;
     };
 
-    class executor
+    // NB: a node of an intrusive, circular doubly linked list; a default constructed node is an empty list (the sentinel) by itself
+    struct list_node
     {
-    public:
-        static executor& singleton()
+        list_node() noexcept
+            : _prev(this)
+            , _next(this)
         {
-            thread_local static executor s_singleton;
-            return s_singleton;
         }
 
-        void add_ready_coro(coroutine_handle<> coro)
+        list_node(const list_node&) = delete;
+        list_node& operator=(const list_node&) = delete;
+
+        ~list_node()
         {
-            _ready_coros.push(coro);
+            unlink();
         }
 
-        void add_timed_wait_coro(std::chrono::high_resolution_clock::time_point when, coroutine_handle<> coro)
+        bool linked() const noexcept { return _next != this; }
+        bool empty() const noexcept { return _next == this; }
+
+        // NB: when used as the sentinel
+        void push_back(list_node& node) noexcept
         {
-            auto r = _timed_wait_coros.emplace(when, std::pair<std::list<coroutine_handle<>>, std::unordered_map<coroutine_handle<>, std::list<coroutine_handle<>>::iterator>>{});
-            assert(r.first->second.first.size() == r.first->second.second.size());
-            r.first->second.first.emplace_back(coro); // NB: the same coroutine cannot be suspended multiple times!
-            r.first->second.second.emplace(coro, --r.first->second.first.end());
-            assert(r.first->second.first.size() == r.first->second.second.size());
+            node.unlink();
+            node._prev = _prev;
+            node._next = this;
+            _prev->_next = &node;
+            _prev = &node;
         }
 
-        void remove_timed_wait_coro(std::chrono::high_resolution_clock::time_point when, coroutine_handle<> coro)
+        void unlink() noexcept
         {
-            auto it = _timed_wait_coros.find(when);
-            if (it != _timed_wait_coros.end())
-            {
-                assert(it->second.first.size() == it->second.second.size());
-                auto it2 = it->second.second.find(coro);
-                if (it2 != it->second.second.end())
-                {
-                    it->second.first.erase(it2->second);
-                    it->second.second.erase(it2);
-                    assert(it->second.first.size() == it->second.second.size());
-                }
-                if (it->second.first.empty())
-                {
-                    _timed_wait_coros.erase(it);
-                }
-            }
+            _prev->_next = _next;
+            _next->_prev = _prev;
+            _prev = _next = this;
         }
 
-        void increment_num_outstanding_coros()
+        list_node* _prev;
+        list_node* _next;
+    };
+
+    // NB: gets notified once an awaitable becomes ready, without any awaiter coroutine involved, see select_set
+    struct watcher : list_node
+    {
+        explicit watcher(void (*notify)(watcher&)) noexcept
+            : _notify(notify)
         {
-            ++_num_outstanding_coros;
         }
 
-        void decrement_num_outstanding_coros()
+        void (*_notify)(watcher&);
+    };
+
+    // NB: a FIFO queue that retains its capacity, unlike std::queue (std::deque) which keeps allocating and freeing blocks as it goes
+    template <class T>
+    class ring_queue {
+    public:
+        bool empty() const noexcept { return _size == 0; }
+        size_t size() const noexcept { return _size; }
+
+        T& front() noexcept { assert(_size > 0); return _buffer[_head]; }
+
+        void push(const T& value)
         {
-            --_num_outstanding_coros;
+            if (_size == _buffer.size())
+            {
+                grow();
+            }
+            _buffer[(_head + _size) % _buffer.size()] = value;
+            ++_size;
         }
 
-        bool tick()
+        void pop() noexcept
         {
-            if (!_ready_coros.empty() || !_timed_wait_coros.empty() || _num_outstanding_coros > 0)
-            {
-                if (!_ready_coros.empty())
-                {
-                    auto coro = _ready_coros.front();
-                    _ready_coros.pop();
+            assert(_size > 0);
+            _head = (_head + 1) % _buffer.size();
+            --_size;
+        }
 
-                    coro.resume();
-                }
+    private:
+        void grow()
+        {
+            std::vector<T> buffer(_buffer.empty() ? 64 : _buffer.size() * 2);
+            for (size_t i = 0; i < _size; ++i)
+            {
+                buffer[i] = _buffer[(_head + i) % _buffer.size()];
+            }
+            _buffer.swap(buffer);
+            _head = 0;
+        }
 
-                while (!_timed_wait_coros.empty())
-                {
-                    auto it = _timed_wait_coros.begin();
-                    if (std::chrono::high_resolution_clock::now() < it->first)
-                        break;
+        std::vector<T> _buffer;
+        size_t _head = 0;
+        size_t _size = 0;
+    };
 
-                    for (auto& coro : it->second.first)
-                    {
-                        _ready_coros.push(coro);
-                    }
+    // NB: in-place storage for a result that may not be default constructible, nor copyable
+    // the value is constructed exactly once, by either return_value or set_ready, and destroyed along with the storage
+    template <class T>
+    class optional_value {
+    public:
+        typedef const T& const_reference;
 
-                    _timed_wait_coros.erase(it);
-                }
+        optional_value() noexcept = default;
+        optional_value(const optional_value&) = delete;
+        optional_value& operator=(const optional_value&) = delete;
 
-                return true;
-            }
+        ~optional_value()
+        {
+            reset();
+        }
 
-            return false;
+        template <typename... Args>
+        void emplace(Args&&... args)
+        {
+            reset();
+            ::new (static_cast<void*>(&_storage)) T(std::forward<Args>(args)...);
+            _engaged = true;
         }
 
-        void loop()
+        void reset() noexcept
         {
-            while (tick())
-                ;
+            if (_engaged)
+            {
+                get().~T();
+                _engaged = false;
+            }
         }
 
+        bool has_value() const noexcept { return _engaged; }
+
+        T& get() noexcept { assert(_engaged); return *reinterpret_cast<T*>(&_storage); }
+        const T& get() const noexcept { assert(_engaged); return *reinterpret_cast<const T*>(&_storage); }
+
+        T move() { return std::move(get()); }
+
     private:
-        executor() = default;
-        ~executor() = default;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type _storage;
+        bool _engaged = false;
+    };
 
-        std::queue<coroutine_handle<>> _ready_coros;
-        std::map<std::chrono::high_resolution_clock::time_point, std::pair<std::list<coroutine_handle<>>, std::unordered_map<coroutine_handle<>, std::list<coroutine_handle<>>::iterator>>> _timed_wait_coros;
+    template <>
+    class optional_value<void> {
+    public:
+        typedef void const_reference;
 
-        int _num_outstanding_coros = 0;
+        void emplace() noexcept {}
+        void reset() noexcept {}
+        bool has_value() const noexcept { return true; }
+        void get() const noexcept {}
+        void move() noexcept {}
     };
 
-    // NB: try keep cancellation sources in scope, and it can freely pass tokens to other coroutines without worrying about becoming dangling
-    class cancellation
-    {
-    private:
-        struct impl
+    // NB: the non-throwing outcome of co_await a.result(), carrying either the value, an error code, or an exception
+    // error codes (including cancellation) are propagated without allocating or unwinding, value() throws only when asked to
+    template <class T>
+    class expected {
+    public:
+        expected(T&& value)
         {
-            typedef std::shared_ptr<impl> ptr;
+            _value.emplace(std::move(value));
+        }
 
-            impl() = default;
-            ~impl() = default;
+        expected(std::error_code error) noexcept
+            : _error(error)
+        {
+        }
 
-            impl(const impl&) = delete;
-            impl(impl&&) = delete;
-            impl& operator=(const impl&) = delete;
+        expected(std::exception_ptr exp) noexcept
+            : _exp(exp)
+        {
+        }
 
-            void fire()
+        expected(expected&& other)
+            : _error(other._error)
+            , _exp(std::move(other._exp))
+        {
+            if (other._value.has_value())
             {
-                for (auto& entry : _registry)
-                {
-                    for (auto& f : entry.second)
-                    {
-                        f();
-                    }
-                }
-
-                _registry.clear();
+                _value.emplace(other._value.move());
             }
+        }
 
-            std::unordered_map<void*, std::deque<std::function<void()>>> _registry;
-        };
+        expected(const expected&) = delete;
+        expected& operator=(const expected&) = delete;
 
-        impl::ptr _impl_ptr;
+        bool has_value() const noexcept { return _value.has_value(); }
+        explicit operator bool() const noexcept { return has_value(); }
 
-    public:
-        cancellation()
-            : _impl_ptr(std::make_shared<impl>())
-        {}
+        bool cancelled() const noexcept { return _error == std::errc::operation_canceled; }
+        std::error_code error() const noexcept { return _error; }
+        std::exception_ptr exception() const noexcept { return _exp; }
 
-        ~cancellation() = default;
-        cancellation(const cancellation&) = default;
-        cancellation& operator=(const cancellation&) = default;
-        cancellation(cancellation&& other) = default;
+        T& value()
+        {
+            check();
+            return _value.get();
+        }
 
-        // NB: try keep the token on the stack or in scope, it would keep effective during the course of co_await!
-        class token
+    private:
+        void check() const
         {
-        public:
-            token(impl::ptr source = nullptr)
-                : _source(source)
+            if (_exp)
             {
+                std::rethrow_exception(_exp);
             }
-
-            token(const token&) = default;
-            token(token&&) = default;
-
-            void register_action(std::function<void()>&& f)
+            if (_error)
             {
-                if (_source)
-                {
-                    auto r = _source->_registry.emplace(this, std::deque<std::function<void()>>{});
-                    r.first->second.emplace_back(std::move(f));
-                }
+                throw std::system_error(_error);
             }
+        }
 
-            void unregister()
-            {
-                if (_source)
-                {
-                    _source->_registry.erase(this);
-                }
-            }
+        optional_value<T> _value;
+        std::error_code _error;
+        std::exception_ptr _exp;
+    };
 
-            ~token()
+    // NB: referencing a result shared by multiple awaiters, which stays valid as long as the awaitable is around
+    template <class T>
+    class expected<T&> {
+    public:
+        expected(T& value) noexcept
+            : _value(std::addressof(value))
+        {
+        }
+
+        expected(std::error_code error) noexcept
+            : _error(error)
+        {
+        }
+
+        expected(std::exception_ptr exp) noexcept
+            : _exp(exp)
+        {
+        }
+
+        bool has_value() const noexcept { return _value != nullptr; }
+        explicit operator bool() const noexcept { return has_value(); }
+
+        bool cancelled() const noexcept { return _error == std::errc::operation_canceled; }
+        std::error_code error() const noexcept { return _error; }
+        std::exception_ptr exception() const noexcept { return _exp; }
+
+        T& value() const
+        {
+            if (_exp)
             {
-                unregister();
+                std::rethrow_exception(_exp);
             }
-
-            static token& none()
+            if (_error)
             {
-                static token s_none;
-                return s_none;
+                throw std::system_error(_error);
             }
+            return *_value;
+        }
 
-        private:
-            impl::ptr _source;
-        };
+    private:
+        T* _value = nullptr;
+        std::error_code _error;
+        std::exception_ptr _exp;
+    };
 
-        token get_token()
+    template <>
+    class expected<void> {
+    public:
+        expected() noexcept = default;
+
+        expected(std::error_code error) noexcept
+            : _error(error)
         {
-            return { _impl_ptr };
         }
 
-        void fire()
+        expected(std::exception_ptr exp) noexcept
+            : _exp(exp)
         {
-            _impl_ptr->fire();
         }
-    };
 
-    // NB: this class is intended for fire and forget type of coroutines
-    // specifically, final_suspend returns suspend_never, so the coroutine will end its course by itself
-    // OTOH, awaitable's final_suspend returns suspend_always, giving await_resume a chance to retrieve any return value or propagate any exception
-    struct nawaitable
-    {
-        struct promise_type
+        bool has_value() const noexcept { return !_error && !_exp; }
+        explicit operator bool() const noexcept { return has_value(); }
+
+        bool cancelled() const noexcept { return _error == std::errc::operation_canceled; }
+        std::error_code error() const noexcept { return _error; }
+        std::exception_ptr exception() const noexcept { return _exp; }
+
+        void value() const
         {
-            nawaitable get_return_object()
+            if (_exp)
             {
-                return {};
+                std::rethrow_exception(_exp);
             }
-
-            auto initial_suspend()
+            if (_error)
             {
-                return suspend_never{};
+                throw std::system_error(_error);
             }
+        }
 
-            auto final_suspend()
-            {
-                return suspend_never{};
-            }
-        };
+    private:
+        std::error_code _error;
+        std::exception_ptr _exp;
     };
 
-    // The API level awaitable, which can be copied freely, while all the state is saved in the internal shared_ptr
-    template <typename T>
-    class awaitable
+#if defined(PI_AWAITABLE_TRACE)
+    // NB: the optional debug/trace layer, enabled by defining PI_AWAITABLE_TRACE; otherwise all the hooks below compile to nothing
+    // it records what every suspended coroutine is waiting on (timer, awaitable, child coroutine ...), as well as the suspend/resume spans
+    class tracer
     {
-    private:
-        class impl
+    public:
+        static constexpr bool enabled = true;
+
+        enum class reason { yield, timer, awaitable, coroutine, schedule };
+
+        static tracer& instance()
         {
-        public:
-            typedef std::shared_ptr<impl> ptr;
+            static tracer s_instance;
+            return s_instance;
+        }
 
-            impl() = default;
-            impl(const impl&) = delete;
-            impl(impl&&) = delete;
-            impl& operator=(const impl&) = delete;
-            ~impl() = default;
+        // awaited is the child coroutine's frame when waiting for a coroutine, otherwise the awaitable's state
+        void on_suspend(coroutine_handle<> coro, reason r, const void* awaited, std::chrono::high_resolution_clock::time_point when = {})
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _suspended[coro.address()] = suspension{ r, awaited, when, std::chrono::high_resolution_clock::now() };
+        }
 
-            explicit impl(bool suspend)
-                : _suspend(suspend)
+        void on_resume(coroutine_handle<> coro)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _suspended.find(coro.address());
+            if (it != _suspended.end())
             {
+                if (_capturing && _events.size() < _max_events)
+                {
+                    // NB: the label is copied, since it's gone along with the coroutine, long before the trace is written
+                    _events.push_back(event{ coro.address(), label(coro.address()), it->second, std::chrono::high_resolution_clock::now(), thread_index() });
+                }
+                _suspended.erase(it);
             }
+        }
 
-            explicit impl(std::chrono::high_resolution_clock::duration timeout)
-                : _when(std::chrono::high_resolution_clock::now() + timeout)
-            {
-            }
+        void on_finish(coroutine_handle<> coro)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _labels.erase(coro.address());
+        }
 
-            template <typename X>
-            struct promise_type_base
+        void set_label(coroutine_handle<> coro, const char* label)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _labels[coro.address()] = label;
+        }
+
+        void start_capture(size_t max_events = 1 << 20)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _events.clear();
+            _max_events = max_events;
+            _capture_start = std::chrono::high_resolution_clock::now();
+            _capturing = true;
+        }
+
+        void stop_capture()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _capturing = false;
+        }
+
+        // Chrome trace-event JSON (chrome://tracing, Perfetto), one complete event per suspend/resume span
+        void write_chrome_trace(std::ostream& os)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+            bool first = true;
+            for (auto& e : _events)
             {
-                X _value = X{};
+                auto ts = duration_cast<microseconds>(e._since.time_since_epoch() - _capture_start.time_since_epoch()).count();
+                auto dur = duration_cast<microseconds>(e._resumed - e._since).count();
+                os << (first ? "" : ",") << "\n{\"name\":\"" << e._label << "\",\"cat\":\"" << name(e._reason)
+                    << "\",\"ph\":\"X\",\"ts\":" << (ts < 0 ? 0 : ts) << ",\"dur\":" << dur << ",\"pid\":1,\"tid\":" << e._tid
+                    << ",\"args\":{\"coro\":\"" << e._coro << "\",\"awaited\":\"" << e._awaited << "\"}}";
+                first = false;
+            }
+            os << "\n]}\n";
+        }
 
-                void return_value(X&& value)
-                {
-                    _value = std::move(value);
-                }
-            };
+        // one async stack per outermost suspended coroutine, following the chain of child coroutines down to the actual wait
+        void dump_async_stacks(std::ostream& os)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto now = std::chrono::high_resolution_clock::now();
 
-            template <>
-            struct promise_type_base<void>
+            std::unordered_set<const void*> children;
+            for (auto& entry : _suspended)
             {
-                void return_void()
+                if (entry.second._reason == reason::coroutine)
                 {
+                    children.insert(entry.second._awaited);
                 }
-            };
+            }
 
-            struct promise_type : promise_type_base<T>
+            for (auto& root : _suspended)
             {
-                awaitable get_return_object()
+                if (children.count(root.first))
                 {
-                    return awaitable{ *this };
+                    continue;
                 }
 
-                auto initial_suspend()
+                os << "async stack:" << std::endl;
+
+                const void* coro = root.first;
+                for (size_t depth = 0; depth <= _suspended.size(); ++depth) // NB: bounded, just in case of a cycle
                 {
-                    // NB: we want the coroutine to run until the first actual suspension point, unless explicitly requested to suspend
-                    return suspend_never{};
-                }
+                    auto it = _suspended.find(coro);
+                    if (it == _suspended.end())
+                    {
+                        os << "    #" << depth << " " << label(coro) << " [" << coro << "] ready or running" << std::endl;
+                        break;
+                    }
 
-                // NB: we need to enforce FIFO ordering
-                std::list<coroutine_handle<>> _awaiter_coros;
+                    auto& s = it->second;
+                    os << "    #" << depth << " " << label(coro) << " [" << coro << "] suspended for "
+                        << duration_cast<milliseconds>(now - s._since).count() << "ms, awaiting " << name(s._reason) << " [" << s._awaited << "]";
+                    if (s._reason == reason::timer)
+                    {
+                        os << " due in " << duration_cast<milliseconds>(s._when - now).count() << "ms";
+                    }
+                    os << std::endl;
 
-                auto final_suspend()
-                {
-                    if (!_awaiter_coros.empty())
+                    if (s._reason != reason::coroutine)
                     {
-                        for (auto coro : _awaiter_coros)
-                        {
-                            executor::singleton().add_ready_coro(coro);
-                            executor::singleton().decrement_num_outstanding_coros();
-                        }
-                        _awaiter_coros.clear();
+                        break;
                     }
-                    return suspend_always{}; // NB: if we want to access the return value in await_resume, we need to keep the current coroutine around, even though coro.done() is now true! 
+                    coro = s._awaited;
                 }
+            }
+        }
 
-                std::exception_ptr _exp;
-                void set_exception(std::exception_ptr exp)
+    private:
+        struct suspension
+        {
+            reason _reason;
+            const void* _awaited;
+            std::chrono::high_resolution_clock::time_point _when;
+            std::chrono::high_resolution_clock::time_point _since;
+        };
+
+        struct event
+        {
+            event(const void* coro, const char* label, const suspension& s, std::chrono::high_resolution_clock::time_point resumed, int tid)
+                : _coro(coro), _label(label), _reason(s._reason), _awaited(s._awaited), _since(s._since), _resumed(resumed), _tid(tid)
+            {
+            }
+
+            const void* _coro;
+            const char* _label;
+            reason _reason;
+            const void* _awaited;
+            std::chrono::high_resolution_clock::time_point _since;
+            std::chrono::high_resolution_clock::time_point _resumed;
+            int _tid;
+        };
+
+        static const char* name(reason r)
+        {
+            switch (r)
+            {
+            case reason::yield: return "yield";
+            case reason::timer: return "timer";
+            case reason::awaitable: return "awaitable";
+            case reason::coroutine: return "coroutine";
+            case reason::schedule: return "schedule_on";
+            }
+            return "";
+        }
+
+        const char* label(const void* coro) const
+        {
+            auto it = _labels.find(coro);
+            return it != _labels.end() ? it->second : "coroutine";
+        }
+
+        int thread_index()
+        {
+            return _threads.emplace(std::this_thread::get_id(), static_cast<int>(_threads.size())).first->second;
+        }
+
+        std::mutex _mutex;
+        std::unordered_map<const void*, suspension> _suspended;
+        std::unordered_map<const void*, const char*> _labels;
+        std::unordered_map<std::thread::id, int> _threads;
+
+        std::vector<event> _events;
+        size_t _max_events = 0;
+        std::chrono::high_resolution_clock::time_point _capture_start;
+        bool _capturing = false;
+    };
+#else
+    class tracer
+    {
+    public:
+        static constexpr bool enabled = false;
+
+        enum class reason { yield, timer, awaitable, coroutine, schedule };
+
+        static tracer& instance()
+        {
+            static tracer s_instance;
+            return s_instance;
+        }
+
+        void on_suspend(coroutine_handle<>, reason, const void*, std::chrono::high_resolution_clock::time_point = {}) {}
+        void on_resume(coroutine_handle<>) {}
+        void on_finish(coroutine_handle<>) {}
+        void set_label(coroutine_handle<>, const char*) {}
+
+        void start_capture(size_t = 0) {}
+        void stop_capture() {}
+        void write_chrome_trace(std::ostream&) {}
+        void dump_async_stacks(std::ostream&) {}
+    };
+#endif
+
+    // NB: co_await trace_label("name") names the current coroutine in the async stacks and trace events; it never suspends
+    class trace_label
+    {
+    public:
+        explicit trace_label(const char* label)
+            : _label(label)
+        {
+        }
+
+        bool await_ready() noexcept
+        {
+            return !tracer::enabled;
+        }
+
+        bool await_suspend(coroutine_handle<> coro) noexcept
+        {
+            tracer::instance().set_label(coro, _label);
+            return false;
+        }
+
+        void await_resume() noexcept
+        {
+        }
+
+    private:
+        const char* _label; // NB: expected to be a string literal
+    };
+
+    // NB: executors can be freely instantiated, e.g. one per shard or subsystem; each is driven by whoever calls tick() or loop()
+    // an awaitable resumes its awaiters on the executor they were suspended on, and co_await schedule_on(ex) hops between executors
+    // NB: only post() is thread-safe, which is what schedule_on uses, so that a coroutine can hop onto an executor driven by another thread;
+    // everything else - the ready queue, the timers, as well as the awaitables, cancellation sources and arenas shared by the coroutines -
+    // is not synchronized at all, so all the executors sharing any of them must be driven from one and the same thread
+    class executor
+    {
+    public:
+        executor() = default;
+        ~executor() = default;
+
+        executor(const executor&) = delete;
+        executor& operator=(const executor&) = delete;
+
+        // NB: an intrusive timer, embedded in the awaiter (thus in the awaiting coroutine's frame), so scheduling it doesn't allocate
+        struct timer
+        {
+            static const size_t npos = static_cast<size_t>(-1);
+
+            std::chrono::high_resolution_clock::time_point _when;
+            coroutine_handle<> _coro;
+            void(*_expire)(timer&) = nullptr; // NB: if set, called on expiry instead of resuming _coro
+            size_t _index = npos; // NB: the position in the executor's timer heap, npos if not scheduled
+            unsigned long long _seq = 0; // NB: guarantee FIFO ordering of the timers with the same deadline
+
+            bool scheduled() const noexcept { return _index != npos; }
+        };
+
+        // the default executor of the current thread
+        static executor& singleton()
+        {
+            thread_local static executor s_singleton;
+            return s_singleton;
+        }
+
+        // the executor that is resuming the current coroutine, or the thread's default executor if not inside tick()
+        static executor& current()
+        {
+            auto ex = current_ptr();
+            return ex ? *ex : singleton();
+        }
+
+        void add_ready_coro(coroutine_handle<> coro)
+        {
+            _ready_coros.push(coro);
+        }
+
+        // NB: the thread-safe flavour of add_ready_coro, picked up by the next tick()
+        void post(coroutine_handle<> coro)
+        {
+            std::lock_guard<std::mutex> lock(_remote_mutex);
+            _remote_coros.emplace_back(coro);
+            _has_remote_coros = true;
+        }
+
+        void add_timer(timer& t)
+        {
+            assert(!t.scheduled());
+            t._seq = _timer_seq++;
+            t._index = _timers.size();
+            _timers.push_back(&t); // NB: the heap's capacity is retained, so steady state scheduling doesn't allocate
+            sift_up(t._index);
+        }
+
+        void remove_timer(timer& t)
+        {
+            if (t.scheduled())
+            {
+                auto index = t._index;
+                t._index = timer::npos;
+
+                if (index != _timers.size() - 1)
                 {
-                    _exp = exp;
+                    _timers[index] = _timers.back();
+                    _timers[index]->_index = index;
+                    _timers.pop_back();
+                    sift_down(sift_up(index));
                 }
-            };
+                else
+                {
+                    _timers.pop_back();
+                }
+            }
+        }
 
-            explicit impl(coroutine_handle<promise_type> coroutine)
-                : _coroutine(coroutine) {}
+        void increment_num_outstanding_coros()
+        {
+            ++_num_outstanding_coros;
+        }
 
-            bool await_ready() noexcept
+        void decrement_num_outstanding_coros()
+        {
+            --_num_outstanding_coros;
+        }
+
+        bool tick()
+        {
+            if (_has_remote_coros)
             {
-                // if I'm enclosing a coroutine, use its status; otherwise, suspend if not ready
-                return _coroutine ? _coroutine.done() : _when != std::chrono::high_resolution_clock::time_point{} ? std::chrono::high_resolution_clock::now() >= _when : _ready;
+                std::lock_guard<std::mutex> lock(_remote_mutex);
+                for (auto coro : _remote_coros)
+                {
+                    _ready_coros.push(coro);
+                }
+                _remote_coros.clear();
+                _has_remote_coros = false;
             }
 
-            void await_suspend(coroutine_handle<> awaiter_coro) noexcept
+            if (!_ready_coros.empty() || !_timers.empty() || _num_outstanding_coros > 0)
             {
-                if (!_coroutine)
+                if (!_ready_coros.empty())
                 {
-                    // I'm not enclosing a coroutine while I'm awaited (await resumable_thing{};), add the awaiter's frame
+                    auto coro = _ready_coros.front();
+                    _ready_coros.pop();
+
+                    tracer::instance().on_resume(coro);
 
-                    if (_when != std::chrono::high_resolution_clock::time_point{})
+                    auto previous = current_ptr();
+                    current_ptr() = this;
+                    coro.resume();
+                    current_ptr() = previous;
+                }
+
+                if (!_timers.empty())
+                {
+                    auto now = std::chrono::high_resolution_clock::now();
+                    while (!_timers.empty() && now >= _timers.front()->_when)
                     {
-                        if (std::chrono::high_resolution_clock::now() >= _when)
+                        auto t = _timers.front();
+                        remove_timer(*t);
+                        if (t->_expire)
                         {
-                            // the timer has already expired - but we should have guarded this situation in await_ready, so this should not happen
-                            // however, if this does happen, we should just put the awaiter_coro into the ready queue
-                            assert(false); // let's make sure this does not happen actually, but nevertheless, we add the awaiter_coro to the ready queue
-                            executor::singleton().add_ready_coro(awaiter_coro);
+                            auto previous = current_ptr();
+                            current_ptr() = this;
+                            t->_expire(*t);
+                            current_ptr() = previous;
                         }
                         else
                         {
-                            _awaiter_coros.emplace_back(awaiter_coro); // NB: guarantee FIFO ordering of the awaiters ...
-                            executor::singleton().add_timed_wait_coro(_when, awaiter_coro);
+                            _ready_coros.push(t->_coro);
                         }
                     }
-                    else if (_suspend)
-                    {
-                        _awaiter_coros.emplace_back(awaiter_coro); // NB: guarantee FIFO ordering of the awaiters ...
-                        executor::singleton().increment_num_outstanding_coros();
-                    }
-                    else
-                    {
-                        executor::singleton().add_ready_coro(awaiter_coro);
-                    }
-                }
-                else
-                {
-                    // I'm waiting for some other coroutine to finish, the awaiter's frame can only be queued until my awaited one finishes
-                    _coroutine.promise()._awaiter_coros.emplace_back(awaiter_coro); // NB: guarantee FIFO ordering of the awaiters ...
-                    executor::singleton().increment_num_outstanding_coros();
                 }
+
+                return true;
             }
 
-            template <typename X>
-            struct value
+            return false;
+        }
+
+        void loop()
+        {
+            while (tick())
+                ;
+        }
+
+        // NB: introspection, e.g. for checking that everything has been drained after a run
+        size_t num_ready_coros() const noexcept
+        {
+            return _ready_coros.size();
+        }
+
+        size_t num_timers() const noexcept
+        {
+            return _timers.size();
+        }
+
+        int num_outstanding_coros() const noexcept
+        {
+            return _num_outstanding_coros;
+        }
+
+    private:
+        static executor*& current_ptr()
+        {
+            thread_local static executor* s_current = nullptr;
+            return s_current;
+        }
+
+        static bool earlier(const timer* t1, const timer* t2)
+        {
+            return t1->_when < t2->_when || (t1->_when == t2->_when && t1->_seq < t2->_seq);
+        }
+
+        size_t sift_up(size_t index)
+        {
+            while (index > 0)
             {
-                X _value = X{};
-                X& get() { return _value; }
-                X move() { return std::move(_value); }
-            };
+                auto parent = (index - 1) / 2;
+                if (!earlier(_timers[index], _timers[parent]))
+                    break;
+
+                std::swap(_timers[index], _timers[parent]);
+                _timers[index]->_index = index;
+                _timers[parent]->_index = parent;
+                index = parent;
+            }
+            return index;
+        }
 
-            template <>
-            struct value<void>
+        size_t sift_down(size_t index)
+        {
+            while (true)
             {
-                void get() {}
-                void move() {}
-            };
+                auto smallest = index;
+                auto left = 2 * index + 1;
+                auto right = left + 1;
+                if (left < _timers.size() && earlier(_timers[left], _timers[smallest]))
+                    smallest = left;
+                if (right < _timers.size() && earlier(_timers[right], _timers[smallest]))
+                    smallest = right;
+                if (smallest == index)
+                    break;
+
+                std::swap(_timers[index], _timers[smallest]);
+                _timers[index]->_index = index;
+                _timers[smallest]->_index = smallest;
+                index = smallest;
+            }
+            return index;
+        }
 
-            template <typename X>
-            struct save_promise_value
+        ring_queue<coroutine_handle<>> _ready_coros;
+
+        // NB: a binary min-heap of the intrusive timers, ordered by deadline
+        std::vector<timer*> _timers;
+        unsigned long long _timer_seq = 0;
+
+        // NB: the coroutines suspended on awaitables, which may still be resumed by set_ready even if nothing else is scheduled
+        int _num_outstanding_coros = 0;
+
+        // NB: the coroutines posted from other threads, see post()
+        std::mutex _remote_mutex;
+        std::vector<coroutine_handle<>> _remote_coros;
+        std::atomic<bool> _has_remote_coros{ false };
+    };
+
+    // NB: co_await schedule_on(ex) suspends the current coroutine, and resumes it on the given executor; see executor for threading
+    class schedule_on
+    {
+    public:
+        explicit schedule_on(executor& ex)
+            : _executor(ex)
+        {
+        }
+
+        bool await_ready() noexcept
+        {
+            return &executor::current() == &_executor;
+        }
+
+        void await_suspend(coroutine_handle<> awaiter_coro) noexcept
+        {
+            tracer::instance().on_suspend(awaiter_coro, tracer::reason::schedule, &_executor);
+            _executor.post(awaiter_coro); // NB: the executor may well be driven by another thread
+        }
+
+        void await_resume() noexcept
+        {
+        }
+
+    private:
+        executor& _executor;
+    };
+
+    // NB: a monotonic, request-scoped arena - allocating is a pointer bump, freeing does nothing but count, and once the last allocation is
+    // gone (i.e. the request's coroutine tree has completed) the whole arena is rewound in one step, keeping its blocks for the next round
+    // beyond its capacity, or for anything larger than a block, allocations fall back to the heap transparently
+    // it's attached to a request through its cancellation source, see cancellation(arena::ptr), and is handed down along with the tokens:
+    // the frame of a coroutine taking a token is allocated from the token's arena, as well as the shared state of the awaitable it returns
+    // NB: must be owned by a shared_ptr, it keeps itself alive while there are live allocations; like cancellation, it's not thread-safe
+    // NB: what's freed within a request is only reused once the whole request is done, trading peak memory for fewer heap allocations
+    class arena : public std::enable_shared_from_this<arena>
+    {
+    public:
+        typedef std::shared_ptr<arena> ptr;
+
+        explicit arena(size_t block_size = 64 * 1024, size_t capacity = 16 * 1024 * 1024)
+            : _block_size(block_size)
+            , _capacity(capacity)
+        {
+        }
+
+        ~arena()
+        {
+            assert(_live == 0);
+            while (_head)
             {
-                static void apply(value<X>& v, promise_type& p)
-                {
-                    v._value = std::move(p._value);
-                }
-            };
+                auto b = _head;
+                _head = b->_next;
+                ::operator delete(b);
+            }
+        }
 
-            template <>
-            struct save_promise_value<void>
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        // NB: allocates from the arena if any and not exhausted, otherwise from the heap; either way, it's freed by deallocate()
+        static void* allocate(arena* a, size_t size)
+        {
+            void* p = a ? a->bump(sizeof(header) + size) : nullptr;
+            if (!p)
             {
-                static void apply(value<void>&, promise_type&)
+                if (a)
                 {
+                    ++a->_num_fallbacks;
+                    a = nullptr;
                 }
-            };
+                p = ::operator new(sizeof(header) + size);
+            }
+            return new (p) header{ a } + 1;
+        }
 
-            T await_resume()
+        static void deallocate(void* p) noexcept
+        {
+            auto h = static_cast<header*>(p) - 1;
+            if (h->_arena)
             {
-                if (_coroutine)
-                {
-                    if (_coroutine.promise()._exp)
-                    {
-                        _exp = _coroutine.promise()._exp;
-                    }
-                    else
-                    {
-                        save_promise_value<T>::apply(_value, _coroutine.promise());
-                    }
+                h->_arena->release();
+            }
+            else
+            {
+                ::operator delete(h);
+            }
+        }
 
-                    // the coroutine is finished, but returned from final_suspend (suspend_always), so we get a chance to retrieve any exception or value
-                    assert(_coroutine.done());
-                    _coroutine.destroy();
-                    _coroutine = nullptr;
-                }
+        // NB: hands the arena of a coroutine's frame over to the shared state of the awaitable it returns, see arena_frame
+        static arena*& frame_arena()
+        {
+            thread_local static arena* s_frame_arena = nullptr;
+            return s_frame_arena;
+        }
 
-                _awaiter_coros.clear();
-                _when = std::chrono::high_resolution_clock::time_point{};
+        size_t num_live() const noexcept { return _live; }
+        size_t num_fallbacks() const noexcept { return _num_fallbacks; }
+        size_t reserved() const noexcept { return _reserved; }
 
-                if (_exp)
-                {
-                    std::rethrow_exception(_exp);
-                }
+    private:
+        struct alignas(std::max_align_t) header
+        {
+            arena* _arena; // NB: nullptr if allocated from the heap
+        };
 
-                return _value.get();
+        struct alignas(std::max_align_t) block
+        {
+            block* _next;
+
+            char* data() noexcept
+            {
+                return reinterpret_cast<char*>(this + 1);
             }
+        };
 
-            void set_ready()
+        void* bump(size_t size)
+        {
+            size = (size + alignof(header) - 1) & ~(alignof(header) - 1);
+            if (size > _block_size)
+            {
+                return nullptr;
+            }
+
+            while (!_current || static_cast<size_t>(_end - _cur) < size)
             {
-                if (!_awaiter_coros.empty())
+                auto next = _current ? _current->_next : _head;
+                if (!next)
                 {
-                    for (auto coro : _awaiter_coros)
+                    if (_reserved + _block_size > _capacity)
                     {
-                        executor::singleton().add_ready_coro(coro);
-                        if (_suspend)
-                        {
-                            executor::singleton().decrement_num_outstanding_coros();
-                        }
-                        else
-                        {
-                            executor::singleton().remove_timed_wait_coro(_when, coro);
-                        }
+                        return nullptr;
+                    }
+                    next = new (::operator new(sizeof(block) + _block_size)) block{ nullptr };
+                    (_current ? _current->_next : _head) = next;
+                    _reserved += _block_size;
+                }
+                _current = next;
+                _cur = next->data();
+                _end = _cur + _block_size;
+            }
+
+            if (_live++ == 0)
+            {
+                _self = shared_from_this();
+            }
+
+            auto p = _cur;
+            _cur += size;
+            return p;
+        }
+
+        void release() noexcept
+        {
+            if (--_live == 0)
+            {
+                // NB: rewind in one step; the arena itself goes away along with _self, if nobody else is holding it
+                _current = nullptr;
+                _cur = _end = nullptr;
+                auto self = std::move(_self);
+            }
+        }
+
+        size_t _block_size;
+        size_t _capacity;
+        size_t _reserved = 0;
+        size_t _num_fallbacks = 0;
+
+        block* _head = nullptr;
+        block* _current = nullptr;
+        char* _cur = nullptr;
+        char* _end = nullptr;
+
+        size_t _live = 0;
+        ptr _self; // NB: keeps the arena alive while there are live allocations
+    };
+
+    // NB: for allocate_shared, falls back to the heap if there's no arena
+    template <typename U>
+    struct arena_allocator
+    {
+        typedef U value_type;
+
+        explicit arena_allocator(arena* a) noexcept
+            : _arena(a)
+        {
+        }
+
+        template <typename V>
+        arena_allocator(const arena_allocator<V>& other) noexcept
+            : _arena(other._arena)
+        {
+        }
+
+        U* allocate(size_t n)
+        {
+            return static_cast<U*>(arena::allocate(_arena, n * sizeof(U)));
+        }
+
+        void deallocate(U* p, size_t) noexcept
+        {
+            arena::deallocate(p);
+        }
+
+        template <typename V>
+        bool operator==(const arena_allocator<V>& other) const noexcept
+        {
+            return _arena == other._arena;
+        }
+
+        template <typename V>
+        bool operator!=(const arena_allocator<V>& other) const noexcept
+        {
+            return _arena != other._arena;
+        }
+
+        arena* _arena;
+    };
+
+    // NB: try keep cancellation sources in scope, and it can freely pass tokens to other coroutines without worrying about becoming dangling
+    class cancellation
+    {
+    public:
+        struct registration;
+
+    private:
+        struct impl : std::enable_shared_from_this<impl>
+        {
+            typedef std::shared_ptr<impl> ptr;
+
+            impl() = default;
+
+            explicit impl(arena::ptr a)
+                : _arena(std::move(a))
+            {
+            }
+
+            // NB: a linked child source, fired along with its parent, while it can also be fired by itself; it shares the parent's arena
+            explicit impl(ptr parent)
+                : _parent(std::move(parent))
+                , _arena(_parent->_arena)
+                , _fired(_parent->_fired)
+            {
+                _next_sibling = _parent->_first_child;
+                if (_next_sibling)
+                {
+                    _next_sibling->_prev_sibling = this;
+                }
+                _parent->_first_child = this;
+            }
+
+            ~impl()
+            {
+                // NB: release the ancestors iteratively, rather than recursively through their destructors
+                ptr parent = detach();
+                while (parent && parent.use_count() == 1)
+                {
+                    parent = parent->detach();
+                }
+            }
+
+            ptr detach()
+            {
+                if (_parent)
+                {
+                    (_prev_sibling ? _prev_sibling->_next_sibling : _parent->_first_child) = _next_sibling;
+                    if (_next_sibling)
+                    {
+                        _next_sibling->_prev_sibling = _prev_sibling;
+                    }
+                    _prev_sibling = _next_sibling = nullptr;
+                }
+                return std::move(_parent);
+            }
+
+            impl(const impl&) = delete;
+            impl(impl&&) = delete;
+            impl& operator=(const impl&) = delete;
+
+            // NB: propagates down the tree iteratively; the pending sources are chained through _next_pending, which also keeps them alive meanwhile
+            void fire()
+            {
+                ptr pending = this->shared_from_this();
+                while (pending)
+                {
+                    ptr current = std::move(pending);
+                    pending = std::move(current->_next_pending);
+
+                    current->fire_self();
+
+                    for (auto child = current->_first_child; child; child = child->_next_sibling)
+                    {
+                        child->_next_pending = std::move(pending);
+                        pending = child->shared_from_this();
+                    }
+                }
+            }
+
+            void fire_self()
+            {
+                _fired = true;
+
+                for (auto& entry : _registry)
+                {
+                    for (auto& f : entry.second)
+                    {
+                        f();
+                    }
+                }
+
+                _registry.clear();
+
+                // NB: unlink before invoking, the action is free to destroy the registration
+                while (_head)
+                {
+                    auto r = _head;
+                    unlink(*r);
+                    r->_action(r->_context);
+                }
+            }
+
+            void link(registration& r)
+            {
+                assert(!r._source);
+                r._source = this;
+                r._prev = _tail;
+                r._next = nullptr;
+                (_tail ? _tail->_next : _head) = &r;
+                _tail = &r;
+            }
+
+            void unlink(registration& r)
+            {
+                assert(r._source == this);
+                (r._prev ? r._prev->_next : _head) = r._next;
+                (r._next ? r._next->_prev : _tail) = r._prev;
+                r._prev = r._next = nullptr;
+                r._source = nullptr;
+            }
+
+            std::unordered_map<void*, std::deque<std::function<void()>>> _registry;
+
+            // NB: the intrusive registrations, in the order of registration
+            registration* _head = nullptr;
+            registration* _tail = nullptr;
+
+            // NB: the parent is kept alive by its children, which unlink themselves from it on destruction
+            ptr _parent;
+            impl* _first_child = nullptr;
+            impl* _prev_sibling = nullptr;
+            impl* _next_sibling = nullptr;
+            ptr _next_pending;
+
+            // NB: the request's arena, if any, see arena
+            arena::ptr _arena;
+
+            bool _fired = false;
+        };
+
+        impl::ptr _impl_ptr;
+
+    public:
+        cancellation()
+            : _impl_ptr(std::make_shared<impl>())
+        {}
+
+        // NB: a root source carrying the request's arena, which is shared by all its linked sources and tokens
+        explicit cancellation(arena::ptr a)
+            : _impl_ptr(std::make_shared<impl>(std::move(a)))
+        {
+        }
+
+        ~cancellation() = default;
+        cancellation(const cancellation&) = default;
+        cancellation& operator=(const cancellation&) = default;
+        cancellation(cancellation&& other) = default;
+
+        // NB: an intrusive registration, embedded in whoever wants to be notified (e.g. an awaiter in a coroutine frame), so that
+        // registering neither allocates nor involves std::function; it must be unlinked before going away, unless it has been fired
+        struct registration
+        {
+            registration(void (*action)(void*), void* context)
+                : _action(action)
+                , _context(context)
+            {
+            }
+
+            registration(const registration&) = delete;
+            registration& operator=(const registration&) = delete;
+
+            ~registration()
+            {
+                unlink();
+            }
+
+            bool linked() const noexcept
+            {
+                return _source != nullptr;
+            }
+
+            void unlink()
+            {
+                if (_source)
+                {
+                    _source->unlink(*this);
+                }
+            }
+
+            void (*_action)(void*);
+            void* _context;
+
+            impl* _source = nullptr;
+            registration* _prev = nullptr;
+            registration* _next = nullptr;
+        };
+
+        // NB: try keep the token on the stack or in scope, it would keep effective during the course of co_await!
+        class token
+        {
+        public:
+            token(impl::ptr source = nullptr)
+                : _source(source)
+            {
+            }
+
+            token(const token&) = default;
+            token(token&&) = default;
+
+            void register_action(std::function<void()>&& f)
+            {
+                if (_source)
+                {
+                    auto r = _source->_registry.emplace(this, std::deque<std::function<void()>>{});
+                    r.first->second.emplace_back(std::move(f));
+                }
+            }
+
+            void unregister()
+            {
+                if (_source)
+                {
+                    _source->_registry.erase(this);
+                }
+            }
+
+            // NB: the token (or any copy of it) must outlive the registration; returns false if there's nothing to register with
+            bool link(registration& r)
+            {
+                if (_source && !_source->_fired)
+                {
+                    _source->link(r);
+                    return true;
+                }
+                return false;
+            }
+
+            bool cancelled() const noexcept
+            {
+                return _source && _source->_fired;
+            }
+
+            arena* get_arena() const noexcept
+            {
+                return _source ? _source->_arena.get() : nullptr;
+            }
+
+            ~token()
+            {
+                unregister();
+            }
+
+            static token& none()
+            {
+                static token s_none;
+                return s_none;
+            }
+
+        private:
+            friend class cancellation;
+
+            impl::ptr _source;
+        };
+
+        // NB: a linked source, fired whenever the parent is, yet it can be fired on its own without affecting the parent
+        explicit cancellation(const token& parent)
+            : _impl_ptr(parent._source ? std::allocate_shared<impl>(arena_allocator<impl>(parent.get_arena()), parent._source) : std::make_shared<impl>())
+        {
+        }
+
+        token get_token()
+        {
+            return { _impl_ptr };
+        }
+
+        void fire()
+        {
+            _impl_ptr->fire();
+        }
+    };
+
+    // NB: the arena a coroutine's frame is allocated from, i.e. the one of the first cancellation token among its arguments, if any
+    inline arena* arena_of(const cancellation::token& ct)
+    {
+        return ct.get_arena();
+    }
+
+    template <typename X>
+    arena* arena_of(const X&)
+    {
+        return nullptr;
+    }
+
+    inline arena* find_arena()
+    {
+        return nullptr;
+    }
+
+    template <typename X, typename... Rest>
+    arena* find_arena(const X& x, const Rest&... rest)
+    {
+        auto a = arena_of(x);
+        return a ? a : find_arena(rest...);
+    }
+
+    // NB: the promise types derive from this, so that a coroutine taking a cancellation token allocates its frame from the token's arena
+    struct arena_frame
+    {
+        template <typename... Args>
+        static void* operator new(size_t size, const Args&... args)
+        {
+            auto a = find_arena(args...);
+            arena::frame_arena() = a;
+            return arena::allocate(a, size);
+        }
+
+        static void operator delete(void* p) noexcept
+        {
+            arena::deallocate(p);
+        }
+    };
+
+    // NB: this class is intended for fire and forget type of coroutines
+    // specifically, final_suspend returns suspend_never, so the coroutine will end its course by itself
+    // OTOH, awaitable's final_suspend returns suspend_always, giving await_resume a chance to retrieve any return value or propagate any exception
+    struct nawaitable
+    {
+        struct promise_type : arena_frame
+        {
+            nawaitable get_return_object()
+            {
+                arena::frame_arena() = nullptr;
+                return {};
+            }
+
+            auto initial_suspend()
+            {
+                return suspend_never{};
+            }
+
+            auto final_suspend()
+            {
+                tracer::instance().on_finish(coroutine_handle<promise_type>::from_promise(*this));
+                return suspend_never{};
+            }
+        };
+    };
+
+    template <typename T>
+    class select_set;
+
+    // The API level awaitable, which can be copied freely, while all the state is saved in the internal shared_ptr
+    template <typename T>
+    class awaitable
+    {
+        template <typename>
+        friend class select_set;
+
+    private:
+        class task_impl;
+
+        // NB: the event core shared by all the kinds of awaitable below; it only knows how to wait for set_ready, and never branches on the kind
+        class impl
+        {
+        public:
+            typedef std::shared_ptr<impl> ptr;
+            typedef typename optional_value<T>::const_reference const_reference;
+
+            impl() = default;
+            impl(const impl&) = delete;
+            impl(impl&&) = delete;
+            impl& operator=(const impl&) = delete;
+
+            struct promise_type;
+
+            // NB: an awaiter suspended on this awaitable, embedded in the awaiter (thus in the awaiting coroutine's frame) so that
+            // suspending doesn't allocate, be it from the heap or an arena; set_ready unlinks it before the awaiter is resumed
+            struct awaiter_node : list_node
+            {
+                awaiter_node() = default;
+
+                // NB: an awaiter may only be copied before it's suspended, the copy starts out unlinked
+                awaiter_node(const awaiter_node& other) noexcept
+                    : list_node()
+                {
+                    assert(!other.linked());
+                }
+
+                coroutine_handle<> _coro;
+                executor* _executor = nullptr;
+            };
+
+            // NB: the return value is constructed in place, directly into the enclosing awaitable's storage
+            template <typename X>
+            struct promise_type_base
+            {
+                void return_value(X&& value)
+                {
+                    auto i = static_cast<promise_type*>(this)->_impl;
+                    if (i && !i->_ready) // NB: the first one wins, e.g. an external set_ready or cancel() may have completed the awaitable already
+                    {
+                        i->_value.emplace(std::move(value));
+                    }
+                }
+
+                void return_value(const X& value)
+                {
+                    auto i = static_cast<promise_type*>(this)->_impl;
+                    if (i && !i->_ready) // NB: the first one wins, e.g. an external set_ready or cancel() may have completed the awaitable already
+                    {
+                        i->_value.emplace(value);
+                    }
+                }
+            };
+
+            template <>
+            struct promise_type_base<void>
+            {
+                void return_void()
+                {
+                }
+            };
+
+            struct promise_type : promise_type_base<T>, arena_frame
+            {
+                awaitable get_return_object()
+                {
+                    return awaitable{ *this };
+                }
+
+                auto initial_suspend()
+                {
+                    // NB: we want the coroutine to run until the first actual suspension point, unless explicitly requested to suspend
+                    return suspend_never{};
+                }
+
+                auto final_suspend()
+                {
+                    tracer::instance().on_finish(coroutine_handle<promise_type>::from_promise(*this));
+
+                    if (_impl)
+                    {
+                        _impl->_coroutine = nullptr;
+                        _impl->set_ready();
+                    }
+                    // NB: the result (or exception) has been saved into the enclosing awaitable already, so the coroutine frame can go away right now
+                    return suspend_never{};
+                }
+
+                void set_exception(std::exception_ptr exp)
+                {
+                    if (_impl && !_impl->_ready)
+                    {
+                        _impl->_exp = exp;
+                    }
+                }
+
+                // the enclosing awaitable's state; reset to nullptr if all the awaitables referencing it are gone before the coroutine finishes
+                task_impl* _impl = nullptr;
+            };
+
+            bool await_ready() noexcept
+            {
+                return _ready;
+            }
+
+            void await_suspend(awaiter_node& node, coroutine_handle<> awaiter_coro) noexcept
+            {
+#if defined(PI_AWAITABLE_TRACE)
+                tracer::instance().on_suspend(awaiter_coro, _trace_reason, _trace_awaited, _trace_when);
+#endif
+                node._coro = awaiter_coro;
+                node._executor = &executor::current();
+                node._executor->increment_num_outstanding_coros();
+                _awaiters.push_back(node); // NB: guarantee FIFO ordering of the awaiters ...
+            }
+
+            // NB: shared by all the awaiters, no copy is made
+            const_reference await_resume()
+            {
+                resume();
+                return _value.get();
+            }
+
+            // NB: the sole owner takes the value away, see take()
+            T await_resume_move(bool sole)
+            {
+                resume();
+                return take(sole);
+            }
+
+            // NB: non-throwing, errors and exceptions are handed over to the awaiter as they are
+            expected<const_reference> await_resume_result()
+            {
+                if (_exp)
+                {
+                    return { _exp };
+                }
+                if (_error)
+                {
+                    return { _error };
+                }
+
+                ensure_value(std::is_default_constructible<T>{});
+                return shared_result(std::is_void<T>{});
+            }
+
+            expected<T> await_resume_result_move(bool sole)
+            {
+                if (_exp)
+                {
+                    return { _exp };
+                }
+                if (_error)
+                {
+                    return { _error };
+                }
+
+                ensure_value(std::is_default_constructible<T>{});
+                if (!sole && !shareable::value)
+                {
+                    return { std::make_error_code(std::errc::operation_not_permitted) }; // NB: see take()
+                }
+                return moved_result(sole, std::is_void<T>{});
+            }
+
+            void set_ready()
+            {
+                if (_ready)
+                {
+                    return; // NB: the first one wins, the value might have been referenced by the awaiters already
+                }
+                _ready = true;
+
+                while (!_awaiters.empty())
+                {
+                    auto node = static_cast<awaiter_node*>(_awaiters._next);
+                    node->unlink();
+
+                    // NB: resume the awaiter on the executor it was suspended on
+                    node->_executor->add_ready_coro(node->_coro);
+                    node->_executor->decrement_num_outstanding_coros();
+                }
+
+                // NB: unlink before notifying, the watcher is free to go away
+                while (!_watchers.empty())
+                {
+                    auto w = static_cast<watcher*>(_watchers._next);
+                    w->unlink();
+                    w->_notify(*w);
+                }
+            }
+
+            // NB: notified right away if ready already
+            void watch(watcher& w)
+            {
+                if (_ready)
+                {
+                    w._notify(w);
+                }
+                else
+                {
+                    _watchers.push_back(w);
+                }
+            }
+
+            template <typename U = T, typename std::enable_if<!std::is_void<U>::value>::type* = nullptr>
+            void set_ready(U&& value)
+            {
+                if (!_ready)
+                {
+                    _value.emplace(std::forward<U>(value));
+                    set_ready();
+                }
+            }
+
+            void set_exception(std::exception_ptr exp)
+            {
+                if (!_ready)
+                {
+                    _exp = exp;
+                    set_ready();
+                }
+            }
+
+            // NB: completes the awaitable with an error code, neither allocation nor exception is involved
+            void set_error(std::error_code error)
+            {
+                if (!_ready)
+                {
+                    _error = error;
+                    set_ready();
+                }
+            }
+
+            const_reference get_value()
+            {
+                ensure_value(std::is_default_constructible<T>{});
+                return _value.get();
+            }
+
+        private:
+            void resume()
+            {
+                if (_exp)
+                {
+                    std::rethrow_exception(_exp);
+                }
+                if (_error)
+                {
+                    throw std::system_error(_error);
+                }
+
+                ensure_value(std::is_default_constructible<T>{});
+            }
+
+            expected<const_reference> shared_result(std::false_type)
+            {
+                return { _value.get() };
+            }
+
+            expected<void> shared_result(std::true_type)
+            {
+                return {};
+            }
+
+            expected<T> moved_result(bool sole, std::false_type)
+            {
+                return { take(sole) };
+            }
+
+            expected<void> moved_result(bool, std::true_type)
+            {
+                return {};
+            }
+
+            typedef std::integral_constant<bool, std::is_copy_constructible<T>::value || std::is_void<T>::value> shareable;
+
+            // NB: the value is moved out only if nobody else could observe it anymore, otherwise it's copied; a non-copyable value
+            // can only be taken by the sole owner, anyone else is refused rather than robbing the others of it
+            T take(bool sole)
+            {
+                return take(sole, shareable{});
+            }
+
+            T take(bool sole, std::true_type)
+            {
+                return sole ? _value.move() : T(_value.get());
+            }
+
+            T take(bool sole, std::false_type)
+            {
+                if (!sole)
+                {
+                    throw std::system_error(std::make_error_code(std::errc::operation_not_permitted));
+                }
+                return _value.move();
+            }
+
+            // NB: timers and valueless set_ready don't carry a value, the awaiters get a default constructed one in this case
+            void ensure_value(std::true_type)
+            {
+                if (!_value.has_value())
+                {
+                    _value.emplace();
+                }
+            }
+
+            void ensure_value(std::false_type)
+            {
+                assert(_value.has_value()); // NB: a non default constructible result is always provided, see awaitable::if_valueless
+            }
+
+            optional_value<T> _value;
+
+            std::exception_ptr _exp;
+            std::error_code _error;
+
+            // the awaiter coroutines along with the executors they were suspended on, waiting for set_ready
+            list_node _awaiters;
+
+            // the watchers to be notified by set_ready, see select_set
+            list_node _watchers;
+
+            bool _ready = false;
+
+#if defined(PI_AWAITABLE_TRACE)
+        protected:
+            // NB: what the awaiters are reported to be waiting on, filled in by the kinds below; this only exists in trace builds
+            tracer::reason _trace_reason = tracer::reason::awaitable;
+            const void* _trace_awaited = this;
+            std::chrono::high_resolution_clock::time_point _trace_when;
+#endif
+        };
+
+        // NB: the coroutine kind, completed by the enclosed coroutine's final_suspend; created by promise_type::get_return_object
+        class task_impl : public impl
+        {
+        public:
+            explicit task_impl(coroutine_handle<typename impl::promise_type> coroutine)
+                : _coroutine(coroutine)
+            {
+                coroutine.promise()._impl = this;
+#if defined(PI_AWAITABLE_TRACE)
+                this->_trace_reason = tracer::reason::coroutine;
+                this->_trace_awaited = coroutine.address();
+#endif
+            }
+
+            ~task_impl()
+            {
+                if (_coroutine)
+                {
+                    // NB: the enclosed coroutine is still running, detach from it so that it can finish its course by itself
+                    _coroutine.promise()._impl = nullptr;
+                }
+            }
+
+        private:
+            friend struct impl::promise_type;
+
+            // the coroutine this awaitable is enclosing while it's still running
+            coroutine_handle<typename impl::promise_type> _coroutine;
+        };
+
+        // NB: the timer kind, an intrusive executor timer that completes the awaitable on expiry; being an ordinary set_ready, it
+        // can be cancelled and watched like any other awaitable. The timer is scheduled on construction, and dropped on completion
+        class timed_impl : public impl, public executor::timer, public watcher
+        {
+        public:
+            explicit timed_impl(std::chrono::high_resolution_clock::duration timeout)
+                : watcher(&timed_impl::on_ready)
+                , _executor(executor::current())
+            {
+                this->_when = std::chrono::high_resolution_clock::now() + timeout;
+                this->_expire = &timed_impl::on_expire;
+#if defined(PI_AWAITABLE_TRACE)
+                this->_trace_reason = tracer::reason::timer;
+                this->_trace_awaited = static_cast<executor::timer*>(this);
+                this->_trace_when = this->_when;
+#endif
+                _executor.add_timer(*this);
+                this->watch(*this);
+            }
+
+            ~timed_impl()
+            {
+                _executor.remove_timer(*this);
+            }
+
+        private:
+            static void on_expire(executor::timer& t)
+            {
+                static_cast<timed_impl&>(t).set_ready();
+            }
+
+            // NB: completed before expiry, e.g. cancelled - there is no point keeping the executor busy any longer
+            static void on_ready(watcher& w)
+            {
+                auto& self = static_cast<timed_impl&>(w);
+                self._executor.remove_timer(self);
+            }
+
+            executor& _executor;
+        };
+
+        typename impl::ptr _impl_ptr;
+
+        // NB: the enclosed coroutine's shared state goes to the same arena as its frame
+        explicit awaitable(typename impl::promise_type& promise)
+            : _impl_ptr(make_impl<task_impl>(std::exchange(arena::frame_arena(), nullptr), coroutine_handle<typename impl::promise_type>::from_promise(promise)))
+        {
+        }
+
+        template <typename Kind, typename... Args>
+        static typename impl::ptr make_impl(arena* a, Args&&... args)
+        {
+            if (a)
+            {
+                return std::allocate_shared<Kind>(arena_allocator<Kind>(a), std::forward<Args>(args)...);
+            }
+            return std::make_shared<Kind>(std::forward<Args>(args)...);
+        }
+
+        struct awaiter
+        {
+            awaiter(impl& i, bool sole = false)
+                : _impl(i)
+                , _sole(sole)
+            {
+            }
+
+            impl& _impl;
+            bool _sole; // NB: whether the awaitable being awaited is the only one referencing the result
+            typename impl::awaiter_node _node;
+
+            bool await_ready() noexcept
+            {
+                return _impl.await_ready();
+            }
+
+            void await_suspend(coroutine_handle<> awaiter_coro) noexcept
+            {
+                _impl.await_suspend(_node, awaiter_coro);
+            }
+
+            typename impl::const_reference await_resume()
+            {
+                return _impl.await_resume();
+            }
+        };
+
+        struct move_awaiter : awaiter
+        {
+            using awaiter::awaiter;
+
+            T await_resume()
+            {
+                return this->_impl.await_resume_move(this->_sole);
+            }
+        };
+
+        struct result_awaiter : awaiter
+        {
+            using awaiter::awaiter;
+
+            expected<typename impl::const_reference> await_resume()
+            {
+                return this->_impl.await_resume_result();
+            }
+        };
+
+        struct move_result_awaiter : awaiter
+        {
+            using awaiter::awaiter;
+
+            expected<T> await_resume()
+            {
+                return this->_impl.await_resume_result_move(this->_sole);
+            }
+        };
+
+    public:
+        struct promise_type : impl::promise_type
+        {
+        };
+
+        // NB: awaitable{} used to yield, use co_await yield() instead; it's deleted rather than turned into an event, which would never resume
+        awaitable() = delete;
+
+        // NB: awaitable{ false }, set_ready() and the timer kind complete without a value, the awaiters get a default constructed one then;
+        // they're ruled out at compile time for a T that isn't default constructible, rather than handing over an uninitialized value
+        template <typename U>
+        using if_valueless = typename std::enable_if<std::is_void<U>::value || std::is_default_constructible<U>::value>::type;
+
+        // NB: the event kind, its awaiters are suspended until set_ready (or set_exception, set_error, cancel); awaitable{ false } is ready right away
+        template <typename U = T, if_valueless<U>* = nullptr>
+        explicit awaitable(bool suspend)
+            : _impl_ptr(std::make_shared<impl>())
+        {
+            if (!suspend)
+            {
+                _impl_ptr->set_ready();
+            }
+        }
+
+        // NB: an event whose shared state is allocated from the given arena (e.g. cancellation::token::get_arena()), or the heap if nullptr;
+        // awaitable{ nullptr } is also how to make an event of any T, including the ones that can't be completed without a value
+        explicit awaitable(arena* a)
+            : _impl_ptr(make_impl<impl>(a))
+        {
+        }
+
+        // NB: the timer kind, which becomes ready once the timeout elapses, counting from now; the timer is armed right away rather than
+        // when first awaited, so a timer awaitable kept around without being awaited keeps the executor's loop() running until it expires
+        template <typename U = T, if_valueless<U>* = nullptr>
+        explicit awaitable(std::chrono::high_resolution_clock::duration timeout)
+            : _impl_ptr(std::make_shared<timed_impl>(timeout))
+        {
+        }
+
+        awaitable(awaitable const&) = default;
+        awaitable& operator=(awaitable const&) = default;
+        awaitable(awaitable&& other) = default;
+        ~awaitable() = default;
+
+        bool operator==(const awaitable& other) const
+        {
+            return _impl_ptr == other._impl_ptr;
+        }
+
+        // NB: there's no await_suspend here, co_await goes through operator co_await below, whose awaiter carries the node to suspend on
+        bool await_ready() noexcept
+        {
+            return _impl_ptr->await_ready();
+        }
+
+        typename impl::const_reference await_resume()
+        {
+            return _impl_ptr->await_resume();
+        }
+
+        // NB: co_await on an lvalue yields a const reference to the result, shared by all the awaiters without copying
+        awaiter operator co_await() const &
+        {
+            return awaiter{ *_impl_ptr };
+        }
+
+        // NB: co_await on an rvalue moves the result out if it's the last awaitable referencing it, otherwise the result is copied;
+        // a non-copyable result that's still shared can't be taken, the awaiter gets errc::operation_not_permitted instead
+        move_awaiter operator co_await() &&
+        {
+            return move_awaiter{ *_impl_ptr, _impl_ptr.use_count() == 1 };
+        }
+
+        template <typename U = T, if_valueless<U>* = nullptr>
+        void set_ready()
+        {
+            _impl_ptr->set_ready();
+        }
+
+        template <typename U = T, typename std::enable_if<!std::is_void<U>::value>::type* = nullptr>
+        void set_ready(U&& value)
+        {
+            _impl_ptr->set_ready(std::forward<U>(value));
+        }
+
+        void set_exception(std::exception_ptr exp)
+        {
+            _impl_ptr->set_exception(exp);
+        }
+
+        void set_error(std::error_code error)
+        {
+            _impl_ptr->set_error(error);
+        }
+
+        // NB: cancellation is just an error code, it doesn't allocate, and it doesn't throw unless the awaiter co_awaits without result()
+        void cancel()
+        {
+            _impl_ptr->set_error(std::make_error_code(std::errc::operation_canceled));
+        }
+
+        // NB: co_await a.result() never throws, it yields an expected<> with either the value, an error code, or an exception
+        result_awaiter result() const &
+        {
+            return result_awaiter{ *_impl_ptr };
+        }
+
+        move_result_awaiter result() &&
+        {
+            return move_result_awaiter{ *_impl_ptr, _impl_ptr.use_count() == 1 };
+        }
+
+        typename impl::const_reference get_value() const
+        {
+            return _impl_ptr->get_value();
+        }
+    private:
+        static void cancel_one(void* context)
+        {
+            static_cast<awaitable*>(context)->cancel();
+        }
+
+        // NB: use of template template parameter is to avoid recursive template instantiation when retrieving the proxy type!
+        //template < template <typename> class _awaitable > // TODO: try without template template parameter
+        static nawaitable await_one(awaitable a, awaitable<awaitable> r, cancellation::token ct = cancellation::token::none())
+        {
+            // NB: the token outlives the registration, both living in this frame, which may be allocated from the token's arena
+            cancellation::registration registration(&awaitable::cancel_one, &a);
+            if (!ct.link(registration) && ct.cancelled())
+            {
+                a.cancel(); // NB: fired already, e.g. a child of a fired source, there's nothing left to be notified by
+            }
+
+            // NB: co_await on the lvalue leaves the result in place, so that 'a' handed over to r still carries it
+            auto result = co_await a.result();
+            if (result)
+            {
+                r.set_ready(a);
+            }
+            else if (result.exception())
+            {
+                r.set_exception(result.exception());
+            }
+            else
+            {
+                r.set_error(result.error());
+            }
+        }
+
+        // NB: use of template template parameter is to avoid recursive template instantiation when retrieving the proxy type!
+        //template < template <typename> class _awaitable > // TODO: try without template template parameter
+        //static nawaitable await_one(awaitable<awaitable> aa, awaitable<awaitable> r, cancellation::token ct = cancellation::token::none())
+        //{
+        //    // NB: the cancellation token will remain in scope until the current function returns
+        //    ct.register_action([&aa] { aa.set_exception(std::make_exception_ptr(std::exception("await_one.cancellation"))); });
+
+        //    try
+        //    {
+        //        co_await aa;
+        //        r.set_ready(aa.get_value());
+        //    }
+        //    catch (...)
+        //    {
+        //        r.set_exception(std::current_exception());
+        //        return;
+        //    }
+        //}
+
+        static nawaitable await_one(awaitable a, awaitable<void> r, size_t& count = 0, cancellation::token ct = cancellation::token::none())
+        {
+            // NB: the token outlives the registration, both living in this frame, which may be allocated from the token's arena
+            cancellation::registration registration(&awaitable::cancel_one, &a);
+            if (!ct.link(registration) && ct.cancelled())
+            {
+                a.cancel(); // NB: fired already, e.g. a child of a fired source, there's nothing left to be notified by
+            }
+
+            auto result = co_await a.result();
+            if (result)
+            {
+                // NB: count lives in the frame awaiting r, which is gone as soon as r is completed, e.g. by another one failing
+                if (!r.await_ready() && count > 0 && --count == 0)
+                {
+                    r.set_ready();
+                }
+            }
+            else if (result.exception())
+            {
+                r.set_exception(result.exception());
+            }
+            else
+            {
+                r.set_error(result.error());
+            }
+        }
+
+    public:
+        static awaitable<awaitable> when_any(std::deque<awaitable>& awaitables, cancellation::token ct = cancellation::token::none())
+        {
+            awaitable<awaitable> r{ ct.get_arena() };
+
+            for (auto a : awaitables)
+            {
+                // NB: cannot register the cancellation action here, since we cannot maintain the call frame here
+                // the cancellation token will be destructed when this function goes out of scope even before await_one ends
+                // thus unregisters the registered action!
+                await_one(a, r, ct);
+            }
+
+            return r;
+        }
+
+        // NB: input type of awaitable&& makes no sense, since the final result is a reference to an most decayed awaitable, an rvalue is temporary in nature, and thus should not be referenced!
+        // so we don't define the following verion
+        // friend awaitable<ref> operator||(awaitable&& a1, awaitable&& a2);
+        // as well as the combinations of awaitable&& with other awaitable types
+
+        // [1]
+        friend awaitable<awaitable> operator||(awaitable a1, awaitable a2)
+        {
+            awaitable<awaitable> r{ nullptr };
+            await_one(a1, r);
+            await_one(a2, r);
+            return r;
+        }
+
+        // [2-1]
+        friend awaitable<awaitable> operator||(awaitable<awaitable> a1, awaitable a2)
+        {
+            // NB: instead of creating another awaitable<awaitable>, we just reuse a1! 
+            await_one(a2, a1);
+            return a1;
+        }
+
+        // [2-2]
+        friend awaitable<awaitable> operator||(awaitable a1, awaitable<awaitable> a2)
+        {
+            return a2 || a1;
+        }
+
+        // [3] - would this collide with the method as defined in the next level (when instantiating awaitable<awaitable> - probably
+        //friend awaitable<awaitable> operator||(awaitable<awaitable> a1, awaitable<awaitable> a2)
+        //{
+        //    awaitable<awaitable> r{ true };
+        //    await_one(a1, r);
+        //    await_one(a2, r);
+        //    return r;
+        //}
+
+        static awaitable<void> when_all(std::deque<awaitable>& awaitables, cancellation::token ct = cancellation::token::none())
+        {
+            awaitable<void> r{ ct.get_arena() };
+
+            size_t count = awaitables.size(); // NB: count remains on the stack due to the co_await below
+            for (auto a : awaitables)
+            {
+                await_one(a, r, count, ct);
+            }
+
+            co_await r;
+        }
+
+        friend awaitable<void> operator&&(awaitable a1, awaitable a2)
+        {
+            awaitable<void> r{ true };
+
+            size_t count = 2; // NB: count remains on the stack due to the co_await below
+            await_one(a1, r, count);
+            await_one(a2, r, count);
+
+            co_await r;
+        }
+
+        template<typename U>
+        friend std::enable_if_t<!std::is_void<U>::value, awaitable<void>> operator&&(awaitable<void> a1, awaitable<U> a2);
+
+        template<typename U>
+        friend std::enable_if_t<!std::is_void<U>::value, awaitable<void>> operator&&(awaitable<U> a1, awaitable<void> a2);
+    };
+
+    template <typename T>
+    std::enable_if_t<!std::is_void<T>::value, awaitable<void>> operator&&(awaitable<void> a1, awaitable<T> a2)
+    {
+        awaitable<void> r{ true };
+
+        size_t count = 2; // NB: count remains on the stack due to the co_await below
+        awaitable<void>::await_one(a1, r, count);
+        awaitable<T>::await_one(a2, r, count);
+
+        co_await r;
+    }
+
+    template <typename T>
+    std::enable_if_t<!std::is_void<T>::value, awaitable<void>> operator&&(awaitable<T> a1, awaitable<void> a2)
+    {
+        return a2 && a1;
+    }
+
+    // NB: an allocation free timed wait - both the timer and the cancellation registration live in the awaiting coroutine's frame, as part of this awaiter
+    // yields an expected<void>, which tells if the wait was cancelled
+    class sleep_awaiter
+    {
+    public:
+        explicit sleep_awaiter(std::chrono::high_resolution_clock::time_point when, cancellation::token ct = cancellation::token::none())
+            : _ct(std::move(ct))
+            , _registration(&sleep_awaiter::cancel, this)
+        {
+            _timer._when = when;
+        }
+
+        sleep_awaiter(const sleep_awaiter& other)
+            : sleep_awaiter(other._timer._when, other._ct)
+        {
+            assert(!other._timer.scheduled());
+        }
+
+        bool await_ready() noexcept
+        {
+            _cancelled = _ct.cancelled();
+            return _cancelled || std::chrono::high_resolution_clock::now() >= _timer._when;
+        }
+
+        void await_suspend(coroutine_handle<> awaiter_coro) noexcept
+        {
+            tracer::instance().on_suspend(awaiter_coro, tracer::reason::timer, &_timer, _timer._when);
+
+            _timer._coro = awaiter_coro;
+            _executor = &executor::current();
+            _executor->add_timer(_timer);
+            _ct.link(_registration);
+        }
+
+        expected<void> await_resume() noexcept
+        {
+            _registration.unlink();
+            if (_cancelled)
+            {
+                return { std::make_error_code(std::errc::operation_canceled) };
+            }
+            return {};
+        }
+
+    private:
+        static void cancel(void* context)
+        {
+            auto self = static_cast<sleep_awaiter*>(context);
+            if (self->_timer.scheduled())
+            {
+                // NB: otherwise the timer has expired already, and the awaiter is about to be resumed anyway
+                self->_cancelled = true;
+                self->_executor->remove_timer(self->_timer);
+                self->_executor->add_ready_coro(self->_timer._coro);
+            }
+        }
+
+        executor::timer _timer;
+        executor* _executor = nullptr;
+        cancellation::token _ct;
+        cancellation::registration _registration;
+        bool _cancelled = false;
+    };
+
+    inline sleep_awaiter sleep_until(std::chrono::high_resolution_clock::time_point when, cancellation::token ct = cancellation::token::none())
+    {
+        return sleep_awaiter{ when, std::move(ct) };
+    }
+
+    inline sleep_awaiter sleep_for(std::chrono::high_resolution_clock::duration duration, cancellation::token ct = cancellation::token::none())
+    {
+        return sleep_awaiter{ std::chrono::high_resolution_clock::now() + duration, std::move(ct) };
+    }
+
+    inline sleep_awaiter operator co_await(std::chrono::high_resolution_clock::duration duration)
+    {
+        return sleep_for(duration);
+    }
+
+    // NB: the yield kind, stateless - the current coroutine is put at the back of the current executor's ready queue
+    class yield_awaiter
+    {
+    public:
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(coroutine_handle<> awaiter_coro) noexcept
+        {
+            tracer::instance().on_suspend(awaiter_coro, tracer::reason::yield, nullptr);
+            executor::current().add_ready_coro(awaiter_coro);
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    inline yield_awaiter yield()
+    {
+        return yield_awaiter{};
+    }
+
+    // NB: as_awaitable() lifts the other kinds above (sleep_for, yield, periodic_timer::tick, async_rate_limiter::acquire ...) into an
+    // awaitable<>, so that they can be mixed with events, timers and coroutines in when_any, when_all and the operators
+    // an expected<> result is unwrapped, i.e. the error or exception it carries completes the awaitable instead
+    // NB: completing the resulting awaitable (e.g. cancel) doesn't stop the adapted one, hand it a cancellation token for that
+    template <typename R>
+    struct adapted
+    {
+        typedef awaitable<R> type;
+
+        template <typename A>
+        static nawaitable forward(A a, type r)
+        {
+            r.set_ready(co_await a);
+        }
+    };
+
+    template <>
+    struct adapted<void>
+    {
+        typedef awaitable<void> type;
+
+        template <typename A>
+        static nawaitable forward(A a, type r)
+        {
+            co_await a;
+            r.set_ready();
+        }
+    };
+
+    template <typename X>
+    struct adapted<expected<X>>
+    {
+        typedef awaitable<X> type;
+
+        template <typename A>
+        static nawaitable forward(A a, type r)
+        {
+            auto result = co_await a;
+            if (result)
+            {
+                r.set_ready(std::move(result.value()));
+            }
+            else if (result.exception())
+            {
+                r.set_exception(result.exception());
+            }
+            else
+            {
+                r.set_error(result.error());
+            }
+        }
+    };
+
+    template <>
+    struct adapted<expected<void>>
+    {
+        typedef awaitable<void> type;
+
+        template <typename A>
+        static nawaitable forward(A a, type r)
+        {
+            auto result = co_await a;
+            if (result)
+            {
+                r.set_ready();
+            }
+            else if (result.exception())
+            {
+                r.set_exception(result.exception());
+            }
+            else
+            {
+                r.set_error(result.error());
+            }
+        }
+    };
+
+    template <typename A, typename R = decltype(std::declval<A&>().await_resume())>
+    typename adapted<R>::type as_awaitable(A a)
+    {
+        typename adapted<R>::type r{ nullptr };
+        adapted<R>::forward(std::move(a), r);
+        return r;
+    }
+
+    // NB: a drift-compensated periodic timer - the deadlines advance by the period from the schedule rather than from when the work is done,
+    // the same intrusive timer is reused across laps, and the missed ticks are coalesced: co_await tick() yields how many periods have elapsed
+    class periodic_timer
+    {
+    public:
+        explicit periodic_timer(std::chrono::high_resolution_clock::duration period, cancellation::token ct = cancellation::token::none())
+            : _period(period)
+            , _next(std::chrono::high_resolution_clock::now() + period)
+            , _ct(std::move(ct))
+            , _registration(&periodic_timer::cancel, this)
+        {
+            assert(period > std::chrono::high_resolution_clock::duration::zero());
+        }
+
+        periodic_timer(const periodic_timer&) = delete;
+        periodic_timer& operator=(const periodic_timer&) = delete;
+
+        ~periodic_timer()
+        {
+            assert(!_timer.scheduled()); // NB: the timer must outlive the awaiting coroutine
+        }
+
+        class tick_awaiter
+        {
+        public:
+            explicit tick_awaiter(periodic_timer& pt)
+                : _pt(pt)
+            {
+            }
+
+            bool await_ready() noexcept
+            {
+                _pt._cancelled = _pt._ct.cancelled();
+                return _pt._cancelled || std::chrono::high_resolution_clock::now() >= _pt._next;
+            }
+
+            void await_suspend(coroutine_handle<> awaiter_coro) noexcept
+            {
+                tracer::instance().on_suspend(awaiter_coro, tracer::reason::timer, &_pt._timer, _pt._next);
+
+                _pt._timer._when = _pt._next;
+                _pt._timer._coro = awaiter_coro;
+                _pt._executor = &executor::current();
+                _pt._executor->add_timer(_pt._timer);
+                _pt._ct.link(_pt._registration);
+            }
+
+            expected<size_t> await_resume() noexcept
+            {
+                _pt._registration.unlink();
+                if (_pt._cancelled)
+                {
+                    return { std::make_error_code(std::errc::operation_canceled) };
+                }
+
+                // NB: coalesce the missed ticks, and schedule the next one on the original cadence
+                auto now = std::chrono::high_resolution_clock::now();
+                size_t ticks = static_cast<size_t>((now - _pt._next) / _pt._period) + 1;
+                _pt._next += _pt._period * ticks;
+                return { std::move(ticks) };
+            }
+
+        private:
+            periodic_timer& _pt;
+        };
+
+        tick_awaiter tick()
+        {
+            return tick_awaiter{ *this };
+        }
+
+    private:
+        static void cancel(void* context)
+        {
+            auto self = static_cast<periodic_timer*>(context);
+            if (self->_timer.scheduled())
+            {
+                self->_cancelled = true;
+                self->_executor->remove_timer(self->_timer);
+                self->_executor->add_ready_coro(self->_timer._coro);
+            }
+        }
+
+        std::chrono::high_resolution_clock::duration _period;
+        std::chrono::high_resolution_clock::time_point _next;
+
+        executor::timer _timer;
+        executor* _executor = nullptr;
+        cancellation::token _ct;
+        cancellation::registration _registration;
+        bool _cancelled = false;
+    };
+
+    // NB: a token bucket rate limiter - co_await acquire(n) waits until n tokens are available; the waiters are served strictly in FIFO order
+    // by a single pump coroutine sleeping on a single timer, rather than one timer per waiter; the waiters themselves live in their coroutine frames
+    class async_rate_limiter
+    {
+    private:
+        struct waiter : list_node
+        {
+            double _n = 0;
+            coroutine_handle<> _coro{ nullptr };
+            executor* _executor = nullptr;
+            bool _cancelled = false;
+
+            void resume(bool cancelled)
+            {
+                unlink();
+                _cancelled = cancelled;
+                _executor->add_ready_coro(_coro);
+                _executor->decrement_num_outstanding_coros();
+            }
+        };
+
+        struct state
+        {
+            typedef std::shared_ptr<state> ptr;
+
+            void refill()
+            {
+                auto now = std::chrono::high_resolution_clock::now();
+                _tokens = std::min(_capacity, _tokens + std::chrono::duration<double>(now - _last).count() * _rate);
+                _last = now;
+            }
+
+            double _rate;
+            double _capacity;
+            double _tokens;
+            std::chrono::high_resolution_clock::time_point _last;
+
+            list_node _waiters; // NB: FIFO
+            cancellation _closing;
+            cancellation* _wake = nullptr; // NB: cuts the pump's sleep short, set while it's sleeping for the head of the queue
+            bool _pumping = false;
+            bool _closed = false;
+        };
+
+        typename state::ptr _state;
+
+    public:
+        // rate in tokens per second, and the bucket holds up to capacity (the burst) tokens, full initially
+        async_rate_limiter(double rate, double capacity)
+            : _state(std::make_shared<state>())
+        {
+            assert(rate > 0 && capacity > 0);
+            _state->_rate = rate;
+            _state->_capacity = capacity;
+            _state->_tokens = capacity;
+            _state->_last = std::chrono::high_resolution_clock::now();
+        }
+
+        async_rate_limiter(const async_rate_limiter&) = delete;
+        async_rate_limiter& operator=(const async_rate_limiter&) = delete;
+
+        ~async_rate_limiter()
+        {
+            // NB: the pending waiters are resumed as cancelled
+            _state->_closed = true;
+            while (!_state->_waiters.empty())
+            {
+                static_cast<waiter*>(_state->_waiters._next)->resume(true);
+            }
+            _state->_closing.fire();
+        }
+
+        class acquire_awaiter
+        {
+        public:
+            acquire_awaiter(async_rate_limiter& limiter, double n, cancellation::token ct)
+                : _state(limiter._state)
+                , _ct(std::move(ct))
+                , _registration(&acquire_awaiter::cancel, this)
+            {
+                assert(n <= _state->_capacity); // NB: otherwise it would never be satisfied
+                _waiter._n = n;
+            }
+
+            acquire_awaiter(const acquire_awaiter& other)
+                : acquire_awaiter(other._state, other._waiter._n, other._ct)
+            {
+                assert(!other._waiter.linked());
+            }
+
+            bool await_ready() noexcept
+            {
+                if (_ct.cancelled())
+                {
+                    _waiter._cancelled = true;
+                    return true;
+                }
+
+                // NB: don't jump the queue
+                if (_state->_waiters.empty())
+                {
+                    _state->refill();
+                    if (_state->_tokens >= _waiter._n)
+                    {
+                        _state->_tokens -= _waiter._n;
+                        return true;
                     }
-
-                    _awaiter_coros.clear();
-                    _when = std::chrono::high_resolution_clock::time_point{};
                 }
-                _ready = true;
+                return false;
             }
 
-            template <typename U = T, typename std::enable_if<!std::is_void<U>::value>::type* = nullptr>
-            void set_ready(U&& value)
+            void await_suspend(coroutine_handle<> awaiter_coro) noexcept
             {
-                _value._value = std::forward<U>(value);
-                set_ready();
-            }
+                tracer::instance().on_suspend(awaiter_coro, tracer::reason::awaitable, _state.get());
 
-            void set_exception(std::exception_ptr exp)
-            {
-                _exp = exp;
-                set_ready();
+                _waiter._coro = awaiter_coro;
+                _waiter._executor = &executor::current();
+                _waiter._executor->increment_num_outstanding_coros();
+                _state->_waiters.push_back(_waiter);
+                _ct.link(_registration);
+
+                if (!_state->_pumping)
+                {
+                    pump(_state);
+                }
             }
 
-            value<T>& get_value()
+            expected<void> await_resume() noexcept
             {
-                return _value;
+                _registration.unlink();
+                if (_waiter._cancelled)
+                {
+                    return { std::make_error_code(std::errc::operation_canceled) };
+                }
+                return {};
             }
 
         private:
-            value<T> _value;
-
-            std::exception_ptr _exp;
+            acquire_awaiter(const typename state::ptr& s, double n, const cancellation::token& ct)
+                : _state(s)
+                , _ct(ct)
+                , _registration(&acquire_awaiter::cancel, this)
+            {
+                _waiter._n = n;
+            }
 
-            // the coroutine this awaitable is enclosing; this is created by promise_type::get_return_object
-            coroutine_handle<promise_type> _coroutine{ nullptr };
+            static void cancel(void* context)
+            {
+                auto self = static_cast<acquire_awaiter*>(context);
+                if (self->_waiter.linked())
+                {
+                    bool head = self->_state->_waiters._next == &self->_waiter;
+                    self->_waiter.resume(true);
 
-            // the awaiter coroutine when this awaitable is a primitive - i.e. it doesn't enclose a coroutine, set only when _coroutine is nullptr!
-            std::list<coroutine_handle<>> _awaiter_coros;
-            std::chrono::high_resolution_clock::time_point _when; // NB: this should be initialized in the constructor, and cannot be modified 
+                    // NB: the pump is sleeping for the head's deficit, wake it up to serve the new head of the queue right away
+                    if (head && self->_state->_wake)
+                    {
+                        self->_state->_wake->fire();
+                    }
+                }
+            }
 
-            bool _ready = false;
-            bool _suspend = false;
+            typename state::ptr _state;
+            waiter _waiter;
+            cancellation::token _ct;
+            cancellation::registration _registration;
         };
 
-        typename impl::ptr _impl_ptr;
-
-        explicit awaitable(typename impl::promise_type& promise)
-            : _impl_ptr(std::make_shared<impl>(coroutine_handle<typename impl::promise_type>::from_promise(promise)))
+        acquire_awaiter acquire(double n = 1, cancellation::token ct = cancellation::token::none())
         {
+            return acquire_awaiter{ *this, n, std::move(ct) };
         }
 
-    public:
-        struct promise_type : impl::promise_type
+    private:
+        static nawaitable pump(typename state::ptr s)
         {
-        };
+            s->_pumping = true;
 
-        awaitable()
-            : _impl_ptr(std::make_shared<impl>())
-        {
-        }
+            while (!s->_closed && !s->_waiters.empty())
+            {
+                s->refill();
 
-        explicit awaitable(bool suspend)
-            : _impl_ptr(std::make_shared<impl>(suspend))
-        {
+                auto head = static_cast<waiter*>(s->_waiters._next);
+                if (s->_tokens >= head->_n)
+                {
+                    s->_tokens -= head->_n;
+                    head->resume(false);
+                }
+                else
+                {
+                    auto wait = std::chrono::duration<double>((head->_n - s->_tokens) / s->_rate);
+                    cancellation wake{ s->_closing.get_token() };
+                    s->_wake = &wake;
+                    co_await sleep_for(std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(wait) + std::chrono::high_resolution_clock::duration{ 1 }, wake.get_token());
+                    s->_wake = nullptr;
+                }
+            }
+
+            s->_pumping = false;
         }
+    };
 
-        explicit awaitable(std::chrono::high_resolution_clock::duration timeout)
-            : _impl_ptr(std::make_shared<impl>(timeout))
+    // NB: an epoll-like set of awaitables - each one is registered once by add(), and co_await next() yields the ready ones in batches
+    // the cost of each wait is O(ready) rather than O(size), as there's neither an awaiter coroutine nor an allocation per awaitable per wait
+    // a ready awaitable is reported once and then dropped from the set
+    template <typename T>
+    class select_set
+    {
+    private:
+        struct entry : watcher
         {
-        }
+            entry(select_set& set, awaitable<T> a)
+                : watcher(&select_set::on_ready)
+                , _set(set)
+                , _awaitable(std::move(a))
+            {
+            }
 
-        awaitable(awaitable const&) = default;
-        awaitable& operator=(awaitable const&) = default;
-        awaitable(awaitable&& other) = default;
-        ~awaitable() = default;
+            select_set& _set;
+            awaitable<T> _awaitable;
+        };
 
-        bool operator==(const awaitable& other) const
-        {
-            return _impl_ptr == other._impl_ptr;
-        }
+        typedef typename awaitable<T>::impl impl;
 
-        bool await_ready() noexcept
-        {
-            return _impl_ptr->await_ready();
-        }
+    public:
+        select_set() = default;
+        select_set(const select_set&) = delete;
+        select_set& operator=(const select_set&) = delete;
 
-        void await_suspend(coroutine_handle<> awaiter_coro) noexcept
+        ~select_set()
         {
-            _impl_ptr->await_suspend(awaiter_coro);
+            assert(!_waiter);
         }
 
-        T await_resume()
+        void add(awaitable<T> a)
         {
-            return _impl_ptr->await_resume();
+            auto i = a._impl_ptr.get();
+            auto r = _entries.emplace(std::piecewise_construct, std::forward_as_tuple(i), std::forward_as_tuple(*this, std::move(a)));
+            if (r.second)
+            {
+                i->watch(r.first->second);
+            }
         }
 
-        void set_ready()
+        bool remove(const awaitable<T>& a)
         {
-            _impl_ptr->set_ready();
+            // NB: the entry unlinks itself, either from the awaitable's watchers, or from the ready list
+            return _entries.erase(a._impl_ptr.get()) > 0;
         }
 
-        template <typename U = T, typename std::enable_if<!std::is_void<U>::value>::type* = nullptr>
-        void set_ready(U&& value)
+        size_t size() const
         {
-            _impl_ptr->set_ready(std::forward<U>(value));
+            return _entries.size();
         }
 
-        void set_exception(std::exception_ptr exp)
+        class next_awaiter
         {
-            _impl_ptr->set_exception(exp);
-        }
+        public:
+            next_awaiter(select_set& set, size_t max_batch)
+                : _set(set)
+                , _max_batch(max_batch)
+            {
+            }
+
+            bool await_ready() noexcept
+            {
+                return !_set._ready.empty() || _set._entries.empty();
+            }
+
+            void await_suspend(coroutine_handle<> awaiter_coro) noexcept
+            {
+                assert(!_set._waiter); // NB: only one awaiter at a time
+
+                tracer::instance().on_suspend(awaiter_coro, tracer::reason::awaitable, &_set);
+
+                _set._waiter = awaiter_coro;
+                _set._executor = &executor::current();
+                _set._executor->increment_num_outstanding_coros();
+            }
+
+            // NB: the batch is owned by the set, and remains valid until the next call to next()
+            const std::vector<awaitable<T>>& await_resume()
+            {
+                auto& batch = _set._batch;
+                batch.clear(); // NB: the capacity is retained
+
+                while (!_set._ready.empty() && batch.size() < _max_batch)
+                {
+                    auto e = static_cast<entry*>(_set._ready._next);
+                    batch.push_back(e->_awaitable);
+                    _set._entries.erase(e->_awaitable._impl_ptr.get());
+                }
+
+                return batch;
+            }
 
-        T get_value()
+        private:
+            select_set& _set;
+            size_t _max_batch;
+        };
+
+        // NB: yields right away with an empty batch if the set is empty
+        next_awaiter next(size_t max_batch = static_cast<size_t>(-1))
         {
-            return _impl_ptr->get_value().get();
+            return { *this, max_batch };
         }
 
     private:
-        // NB: use of template template parameter is to avoid recursive template instantiation when retrieving the proxy type!
-        //template < template <typename> class _awaitable > // TODO: try without template template parameter
-        static nawaitable await_one(awaitable a, awaitable<awaitable> r, cancellation::token ct = cancellation::token::none())
+        static void on_ready(watcher& w)
         {
-            // NB: the cancellation token will remain in scope until the current function returns
-            ct.register_action([&a] { a.set_exception(std::make_exception_ptr(std::exception("await_one.cancellation"))); });
+            auto& e = static_cast<entry&>(w);
+            auto& set = e._set;
 
-            try
-            {
-                // TODO: await_resume moves the result out, and here we need to retain the value, and probably need to set it back to 'a'
-                // the challenge now is to deal gracefully both the void and non-void return types with co_await!
-                co_await a;
-                r.set_ready(a);
-            }
-            catch (...)
+            set._ready.push_back(e);
+
+            if (set._waiter)
             {
-                r.set_exception(std::current_exception());
-                return;
+                auto coro = set._waiter;
+                set._waiter = nullptr;
+                set._executor->add_ready_coro(coro);
+                set._executor->decrement_num_outstanding_coros();
             }
         }
 
-        // NB: use of template template parameter is to avoid recursive template instantiation when retrieving the proxy type!
-        //template < template <typename> class _awaitable > // TODO: try without template template parameter
-        //static nawaitable await_one(awaitable<awaitable> aa, awaitable<awaitable> r, cancellation::token ct = cancellation::token::none())
-        //{
-        //    // NB: the cancellation token will remain in scope until the current function returns
-        //    ct.register_action([&aa] { aa.set_exception(std::make_exception_ptr(std::exception("await_one.cancellation"))); });
+        std::unordered_map<impl*, entry> _entries;
+        list_node _ready;
+        std::vector<awaitable<T>> _batch;
 
-        //    try
-        //    {
-        //        co_await aa;
-        //        r.set_ready(aa.get_value());
-        //    }
-        //    catch (...)
-        //    {
-        //        r.set_exception(std::current_exception());
-        //        return;
-        //    }
-        //}
+        coroutine_handle<> _waiter{ nullptr };
+        executor* _executor = nullptr;
+    };
 
-        static nawaitable await_one(awaitable a, awaitable<void> r, size_t& count = 0, cancellation::token ct = cancellation::token::none())
+    // NB: request coalescing on top of the shared awaitable state - concurrent get() calls with the same key share one in-flight awaitable
+    // completed values stay cached, bounded by LRU and expired after ttl by a single executor timer; failures are never cached
+    // co_await the returned awaitable as an lvalue to get a const reference to the cached value, an rvalue co_await makes a copy
+    template <typename Key, typename T, typename Hash = std::hash<Key>>
+    class single_flight
+    {
+        static_assert(std::is_copy_constructible<T>::value, "the cached values are shared by all the callers, thus must be copyable");
+
+    private:
+        struct entry
+        {
+            bool in_flight() const
+            {
+                return _expiry == std::chrono::high_resolution_clock::time_point{};
+            }
+
+            awaitable<T> _awaitable;
+            typename std::list<Key>::iterator _lru; // NB: only valid once completed, the in-flight entries aren't in the LRU list
+            std::chrono::high_resolution_clock::time_point _expiry; // NB: remains zero while still in flight
+        };
+
+        struct state
         {
-            // NB: the cancellation token will remain in scope until the current function returns
-            ct.register_action([&a] { a.set_exception(std::make_exception_ptr(std::exception("await_one.cancellation"))); });
+            typedef std::shared_ptr<state> ptr;
 
-            try
+            state(size_t capacity, std::chrono::high_resolution_clock::duration ttl)
+                : _capacity(capacity)
+                , _ttl(ttl)
             {
-                co_await a;
+            }
 
-                if (count > 0 && --count == 0)
+            void erase(typename std::unordered_map<Key, entry, Hash>::iterator it)
+            {
+                if (!it->second.in_flight())
                 {
-                    r.set_ready();
+                    _lru.erase(it->second._lru);
                 }
+                _entries.erase(it);
             }
-            catch (...)
+
+            // NB: only the completed entries are evicted; evicting an in-flight one would let the next get() for the key load it again
+            // while the first load is still going, so the in-flight ones may exceed the capacity until they settle
+            void trim()
             {
-                r.set_exception(std::current_exception());
-                return;
+                while (_entries.size() > _capacity && !_lru.empty())
+                {
+                    erase(_entries.find(_lru.back()));
+                }
             }
-        }
 
-    public:
-        static awaitable<awaitable> when_any(std::deque<awaitable>& awaitables, cancellation::token ct = cancellation::token::none())
-        {
-            awaitable<awaitable> r{ true };
+            size_t _capacity;
+            std::chrono::high_resolution_clock::duration _ttl;
 
-            for (auto a : awaitables)
-            {
-                // NB: cannot register the cancellation action here, since we cannot maintain the call frame here
-                // the cancellation token will be destructed when this function goes out of scope even before await_one ends
-                // thus unregisters the registered action!
-                await_one(a, r, ct);
-            }
+            std::unordered_map<Key, entry, Hash> _entries;
+            std::list<Key> _lru; // NB: the completed entries, the most recently used first
 
-            return r;
-        }
+            // NB: in the order of completion, which is also the order of expiry, given the fixed ttl
+            std::deque<std::pair<std::chrono::high_resolution_clock::time_point, Key>> _expiries;
+            awaitable<void> _sweep_timer{ true };
+            bool _sweeping = false;
+            bool _closed = false;
+        };
 
-        // NB: input type of awaitable&& makes no sense, since the final result is a reference to an most decayed awaitable, an rvalue is temporary in nature, and thus should not be referenced!
-        // so we don't define the following verion
-        // friend awaitable<ref> operator||(awaitable&& a1, awaitable&& a2);
-        // as well as the combinations of awaitable&& with other awaitable types
+        typename state::ptr _state;
 
-        // [1]
-        friend awaitable<awaitable> operator||(awaitable a1, awaitable a2)
+    public:
+        single_flight(size_t capacity, std::chrono::high_resolution_clock::duration ttl)
+            : _state(std::make_shared<state>(capacity, ttl))
         {
-            awaitable<awaitable> r{ true };
-            await_one(a1, r);
-            await_one(a2, r);
-            return r;
+            assert(capacity > 0);
         }
 
-        // [2-1]
-        friend awaitable<awaitable> operator||(awaitable<awaitable> a1, awaitable a2)
-        {
-            // NB: instead of creating another awaitable<awaitable>, we just reuse a1! 
-            await_one(a2, a1);
-            return a1;
-        }
+        single_flight(const single_flight&) = delete;
+        single_flight& operator=(const single_flight&) = delete;
 
-        // [2-2]
-        friend awaitable<awaitable> operator||(awaitable a1, awaitable<awaitable> a2)
+        ~single_flight()
         {
-            return a2 || a1;
+            // NB: in-flight loads still finish by themselves, but the sweeper must not keep the executor busy
+            _state->_closed = true;
+            _state->_sweep_timer.cancel();
         }
 
-        // [3] - would this collide with the method as defined in the next level (when instantiating awaitable<awaitable> - probably
-        //friend awaitable<awaitable> operator||(awaitable<awaitable> a1, awaitable<awaitable> a2)
-        //{
-        //    awaitable<awaitable> r{ true };
-        //    await_one(a1, r);
-        //    await_one(a2, r);
-        //    return r;
-        //}
-
-        static awaitable<void> when_all(std::deque<awaitable>& awaitables, cancellation::token ct = cancellation::token::none())
+        // loader is only invoked if there's neither an in-flight nor an unexpired cached awaitable for the key, and must return awaitable<T>
+        template <typename Loader>
+        awaitable<T> get(const Key& key, Loader&& loader)
         {
-            awaitable<void> r{ true };
+            auto& s = *_state;
 
-            size_t count = awaitables.size(); // NB: count remains on the stack due to the co_await below
-            for (auto a : awaitables)
+            auto it = s._entries.find(key);
+            if (it != s._entries.end())
             {
-                await_one(a, r, count, ct);
+                if (it->second.in_flight())
+                {
+                    return it->second._awaitable;
+                }
+                if (std::chrono::high_resolution_clock::now() < it->second._expiry)
+                {
+                    s._lru.splice(s._lru.begin(), s._lru, it->second._lru);
+                    return it->second._awaitable;
+                }
+                s.erase(it);
             }
 
-            co_await r;
+            awaitable<T> a = loader();
+
+            s._entries.emplace(key, entry{ a, s._lru.end(), {} });
+            s.trim();
+
+            settle(_state, key, a);
+
+            return a;
         }
 
-        friend awaitable<void> operator&&(awaitable a1, awaitable a2)
+        void erase(const Key& key)
         {
-            awaitable<void> r{ true };
-
-            size_t count = 2; // NB: count remains on the stack due to the co_await below
-            await_one(a1, r, count);
-            await_one(a2, r, count);
+            auto it = _state->_entries.find(key);
+            if (it != _state->_entries.end())
+            {
+                _state->erase(it);
+            }
+        }
 
-            co_await r;
+        size_t size() const
+        {
+            return _state->_entries.size();
         }
 
-        template<typename U>
-        friend std::enable_if_t<!std::is_void<U>::value, awaitable<void>> operator&&(awaitable<void> a1, awaitable<U> a2);
+    private:
+        static nawaitable settle(typename state::ptr s, Key key, awaitable<T> a)
+        {
+            auto result = co_await a.result();
 
-        template<typename U>
-        friend std::enable_if_t<!std::is_void<U>::value, awaitable<void>> operator&&(awaitable<U> a1, awaitable<void> a2);
-    };
+            // NB: the entry might have been evicted, or even replaced, in the meantime
+            auto it = s->_entries.find(key);
+            if (it != s->_entries.end() && it->second._awaitable == a)
+            {
+                if (result)
+                {
+                    it->second._expiry = std::chrono::high_resolution_clock::now() + s->_ttl;
+                    s->_expiries.emplace_back(it->second._expiry, key);
 
-    template <typename T>
-    std::enable_if_t<!std::is_void<T>::value, awaitable<void>> operator&&(awaitable<void> a1, awaitable<T> a2)
-    {
-        awaitable<void> r{ true };
+                    s->_lru.push_front(key);
+                    it->second._lru = s->_lru.begin();
+                    s->trim();
 
-        size_t count = 2; // NB: count remains on the stack due to the co_await below
-        awaitable<void>::await_one(a1, r, count);
-        awaitable<T>::await_one(a2, r, count);
+                    if (!s->_sweeping && !s->_closed)
+                    {
+                        sweep(s);
+                    }
+                }
+                else
+                {
+                    s->erase(it); // NB: failures are not cached, the next get() retries
+                }
+            }
+        }
 
-        co_await r;
-    }
+        // NB: a single timer, always armed for the earliest expiry, for the whole cache
+        static nawaitable sweep(typename state::ptr s)
+        {
+            s->_sweeping = true;
 
-    template <typename T>
-    std::enable_if_t<!std::is_void<T>::value, awaitable<void>> operator&&(awaitable<T> a1, awaitable<void> a2)
-    {
-        return a2 && a1;
-    }
+            while (!s->_closed && !s->_expiries.empty())
+            {
+                auto now = std::chrono::high_resolution_clock::now();
+                auto& head = s->_expiries.front();
+                if (now < head.first)
+                {
+                    s->_sweep_timer = awaitable<void>{ head.first - now };
+                    co_await s->_sweep_timer.result(); // NB: cancelled when the cache goes away
+                }
+                else
+                {
+                    auto it = s->_entries.find(head.second);
+                    if (it != s->_entries.end() && it->second._expiry == head.first)
+                    {
+                        s->erase(it);
+                    }
+                    s->_expiries.pop_front();
+                }
+            }
 
-    auto operator co_await(std::chrono::high_resolution_clock::duration duration)
-    {
-        return awaitable<void>{duration};
-    }
+            s->_sweeping = false;
+        }
+    };
 }
 